@@ -18,6 +18,7 @@
  */
 #include "esp_bt_api.h"
 #include "esp_api.h"
+#include "esp_checksum.h"
 
 #define INVALID_HDEV_BUS (0xff)
 
@@ -85,8 +86,7 @@ ESP_BT_SEND_FRAME_PROTOTYPE()
     struct hci_dev * hdev = (struct hci_dev *)(skb->dev);
 #endif
 	struct esp_adapter *adapter = hci_get_drvdata(hdev);
-	struct sk_buff *new_skb;
-	u8 pad_len = 0, realloc_skb = 0;
+	u8 pad_len = 0;
 	u8 *pos = NULL;
 	u8 pkt_type;
 
@@ -105,42 +105,20 @@ ESP_BT_SEND_FRAME_PROTOTYPE()
 
 	pkt_type = hci_skb_pkt_type(skb);
 
-	if (skb_headroom(skb) < pad_len) {
-		/* Headroom is not sufficient */
-		realloc_skb = 1;
-	}
-
-	if (realloc_skb || !IS_ALIGNED((unsigned long) skb->data, SKB_DATA_ADDR_ALIGNMENT)) {
-		/* Realloc SKB */
-		if (skb_linearize(skb)) {
-			hdev->stat.err_tx++;
-			return -EINVAL;
-		}
-
-		new_skb = esp_alloc_skb(skb->len + pad_len);
-
-		if (!new_skb) {
-			printk(KERN_ERR "%s: Failed to allocate SKB", __func__);
-			hdev->stat.err_tx++;
-			return -ENOMEM;
-		}
-
-		pos = new_skb->data;
+	/* bt_cb() shares skb->cb with esp_skb_cb, transport must not
+	 * take it for priv of a network interface */
+	memset(skb->cb, 0, sizeof(struct esp_skb_cb));
 
-		pos += pad_len;
-
-		/* Populate new SKB */
-		skb_copy_from_linear_data(skb, pos, skb->len);
-		skb_put(new_skb, skb->len);
-
-		/* Replace old SKB */
-		dev_kfree_skb_any(skb);
-		skb = new_skb;
-	} else {
-		/* Realloc is not needed, Make space for interface header */
-		skb_push(skb, pad_len);
+	/* Push header in place, head is copied only if it is cloned or
+	 * short of headroom */
+	if (skb_cow_head(skb, pad_len)) {
+		printk(KERN_ERR "%s: Failed to expand SKB head", __func__);
+		hdev->stat.err_tx++;
+		return -ENOMEM;
 	}
 
+	skb_push(skb, pad_len);
+
 	hdr = (struct esp_payload_header *) skb->data;
 
 	memset (hdr, 0, sizeof(struct esp_payload_header));
@@ -154,15 +132,17 @@ ESP_BT_SEND_FRAME_PROTOTYPE()
 	/* set HCI packet type */
 	*(pos + pad_len - 1) = pkt_type;
 
-	hdr->checksum = cpu_to_le16(compute_checksum(skb->data, (len + pad_len)));
+	if (esp_is_checksum_needed(adapter))
+		hdr->checksum = cpu_to_le16(esp_compute_skb_checksum(skb));
 
+	/* skb is consumed by transport */
 	ret = esp_send_packet(adapter, skb);
 
 	if (ret) {
 		hdev->stat.err_tx++;
 		return ret;
 	} else {
-		esp_hci_update_tx_counter(hdev, hdr->hci_pkt_type, skb->len);
+		esp_hci_update_tx_counter(hdev, pkt_type, len + pad_len);
 	}
 
 	return 0;
@@ -137,8 +137,9 @@ struct wireless_dev *esp_cfg80211_add_iface(struct wiphy *wiphy,
 		return NULL;
 	}
 
-	ndev = alloc_netdev(sizeof(struct esp_wifi_device), name, name_assign_type,
-			ether_setup);
+	/* One TX queue per WMM access category */
+	ndev = alloc_netdev_mqs(sizeof(struct esp_wifi_device), name, name_assign_type,
+			ether_setup, ESP_MAX_AC, 1);
 
 	if (!ndev)
 		return ERR_PTR(-ENOMEM);
@@ -0,0 +1,201 @@
+/*
+ * Espressif Systems Wireless LAN device driver
+ *
+ * Copyright (C) 2015-2021 Espressif Systems (Shanghai) PTE LTD
+ *
+ * This software file (the "File") is distributed by Espressif Systems (Shanghai)
+ * PTE LTD under the terms of the GNU General Public License Version 2, June 1991
+ * (the "License").  You may use, redistribute and/or modify this File in
+ * accordance with the terms and conditions of the License, a copy of which
+ * is available by writing to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA or on the
+ * worldwide web at http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt.
+ *
+ * THE FILE IS DISTRIBUTED AS-IS, WITHOUT WARRANTY OF ANY KIND, AND THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE
+ * ARE EXPRESSLY DISCLAIMED.  The License provides additional details about
+ * this warranty disclaimer.
+ */
+#include <linux/kernel.h>
+#include <linux/skbuff.h>
+#include "esp_checksum.h"
+
+#ifdef CONFIG_ENABLE_CHECKSUM_BENCHMARK
+#include <linux/random.h>
+#include <linux/ktime.h>
+#endif
+
+#ifdef CONFIG_KERNEL_MODE_NEON
+#include <asm/neon.h>
+#include <asm/simd.h>
+
+/* Sum of bytes over 'blocks' 64 byte blocks, esp_checksum_neon.S */
+asmlinkage u32 esp_checksum_neon(const u8 *buf, u32 blocks);
+
+/* Below this, NEON context save/restore costs more than it saves */
+#define ESP_CHECKSUM_NEON_MIN_LEN   256
+#define ESP_CHECKSUM_NEON_BLOCK     64
+#endif
+
+/* 0x00FF00FF... : one byte in every 16 bit lane of a word */
+#define BYTE_LANES_MASK             (~0UL / 0xFFFF * 0xFF)
+
+/* Every word adds at most 2 * 0xFF to a 16 bit lane */
+#define MAX_WORDS_PER_FOLD          (0xFFFF / (2 * 0xFF))
+
+static u32 fold_lanes(unsigned long acc)
+{
+	u32 sum = 0;
+
+	while (acc) {
+		sum += acc & 0xFFFF;
+		acc >>= 16;
+	}
+
+	return sum;
+}
+
+/* Sum of bytes, a machine word at a time */
+static u32 checksum_words(const u8 *buf, u32 len)
+{
+	unsigned long acc, word;
+	u32 sum = 0, words, i;
+
+	/* Bytes up to word boundary */
+	while (len && !IS_ALIGNED((unsigned long) buf, sizeof(unsigned long))) {
+		sum += *buf++;
+		len--;
+	}
+
+	while (len >= sizeof(unsigned long)) {
+		words = min_t(u32, len / sizeof(unsigned long), MAX_WORDS_PER_FOLD);
+		acc = 0;
+
+		/* Add even and odd bytes into 16 bit lanes */
+		for (i = 0; i < words; i++) {
+			word = *(const unsigned long *) buf;
+			acc += (word & BYTE_LANES_MASK) + ((word >> 8) & BYTE_LANES_MASK);
+			buf += sizeof(unsigned long);
+		}
+
+		sum += fold_lanes(acc);
+		len -= words * sizeof(unsigned long);
+	}
+
+	while (len--)
+		sum += *buf++;
+
+	return sum;
+}
+
+u16 esp_checksum(const u8 *buf, u32 len)
+{
+	u32 sum = 0;
+
+#ifdef CONFIG_KERNEL_MODE_NEON
+	u32 blocks = len / ESP_CHECKSUM_NEON_BLOCK;
+
+	if (len >= ESP_CHECKSUM_NEON_MIN_LEN && may_use_simd()) {
+		kernel_neon_begin();
+		sum = esp_checksum_neon(buf, blocks);
+		kernel_neon_end();
+
+		buf += blocks * ESP_CHECKSUM_NEON_BLOCK;
+		len -= blocks * ESP_CHECKSUM_NEON_BLOCK;
+	}
+#endif
+
+	sum += checksum_words(buf, len);
+
+	return (u16) sum;
+}
+
+/* esp_checksum() over whole frame, including paged frags */
+u16 esp_compute_skb_checksum(struct sk_buff *skb)
+{
+	struct sk_buff *frag_skb = NULL;
+	const skb_frag_t *frag = NULL;
+	u16 checksum = 0;
+	int i = 0;
+
+	checksum = esp_checksum(skb->data, skb_headlen(skb));
+
+	/* NETIF_F_HIGHDMA is not advertised, so frags are in lowmem */
+	for (i = 0; i < skb_shinfo(skb)->nr_frags; i++) {
+		frag = &skb_shinfo(skb)->frags[i];
+		checksum += esp_checksum(skb_frag_address(frag), skb_frag_size(frag));
+	}
+
+	skb_walk_frags(skb, frag_skb)
+		checksum += esp_compute_skb_checksum(frag_skb);
+
+	return checksum;
+}
+
+/* Firmware may declare link reliable enough to go without checksum */
+u8 esp_is_checksum_needed(struct esp_adapter *adapter)
+{
+	return !(adapter->ext_capabilities & ESP_CHECKSUM_SKIP);
+}
+
+#ifdef CONFIG_ENABLE_CHECKSUM_BENCHMARK
+
+#define BENCHMARK_BUF_SIZE          1600
+#define BENCHMARK_MAX_OFFSET        8
+#define BENCHMARK_ITERATIONS        10000
+
+void esp_checksum_benchmark(void)
+{
+	static const u32 lengths[] = { 64, 256, 512, 1500 };
+	u64 start, byte_loop_ns, word_ns;
+	u32 len, offset, i, j;
+	/* Each result is stored and buf is re-read after barrier(), so that
+	 * compiler can neither drop nor hoist the checksum calls */
+	volatile u16 sink = 0;
+	u8 *buf;
+
+	buf = kmalloc(BENCHMARK_BUF_SIZE + BENCHMARK_MAX_OFFSET, GFP_KERNEL);
+
+	if (!buf)
+		return;
+
+	get_random_bytes(buf, BENCHMARK_BUF_SIZE + BENCHMARK_MAX_OFFSET);
+
+	/* Result must match reference for every length and alignment */
+	for (offset = 0; offset < BENCHMARK_MAX_OFFSET; offset++) {
+		for (len = 0; len <= BENCHMARK_BUF_SIZE; len++) {
+			if (esp_checksum(buf + offset, len) !=
+			    compute_checksum(buf + offset, len)) {
+				printk(KERN_ERR "%s: checksum mismatch, len %u offset %u\n",
+						__func__, len, offset);
+				kfree(buf);
+				return;
+			}
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(lengths); i++) {
+		len = lengths[i];
+
+		start = ktime_get_ns();
+		for (j = 0; j < BENCHMARK_ITERATIONS; j++) {
+			sink = compute_checksum(buf, len);
+			barrier();
+		}
+		byte_loop_ns = ktime_get_ns() - start;
+
+		start = ktime_get_ns();
+		for (j = 0; j < BENCHMARK_ITERATIONS; j++) {
+			sink = esp_checksum(buf, len);
+			barrier();
+		}
+		word_ns = ktime_get_ns() - start;
+
+		printk(KERN_INFO "esp32: checksum of %u bytes: byte loop %llu ns, esp_checksum %llu ns\n",
+				len, div_u64(byte_loop_ns, BENCHMARK_ITERATIONS),
+				div_u64(word_ns, BENCHMARK_ITERATIONS));
+	}
+
+	kfree(buf);
+}
+#endif
@@ -25,7 +25,6 @@
 	print_hex_dump(KERN_INFO, STR, DUMP_PREFIX_ADDRESS, 16, 1, ARG, ARG_LEN, 1);
 
 #define COMMAND_RESPONSE_TIMEOUT (5 * HZ)
-u8 ap_bssid[MAC_ADDR_LEN];
 
 int internal_scan_request(struct esp_wifi_device *priv, char* ssid,
 		uint8_t channel, uint8_t is_blocking);
@@ -293,10 +292,7 @@ static void esp_cmd_work(struct work_struct *work)
 	struct command_node *cmd_node = NULL;
 	struct esp_adapter * adapter = NULL;
 
-	adapter = esp_get_adapter();
-
-	if (!adapter)
-		return;
+	adapter = container_of(work, struct esp_adapter, cmd_work);
 
 	if (adapter->cur_cmd) {
 		//TODO: there should be failure reported to
@@ -347,7 +343,7 @@ static void esp_cmd_work(struct work_struct *work)
 
 static int create_cmd_wq(struct esp_adapter *adapter)
 {
-	adapter->cmd_wq = alloc_workqueue("ESP_CMD_WORK_QUEUE", 0, 0);
+	adapter->cmd_wq = alloc_workqueue("ESP_CMD_WORK_QUEUE/%d", 0, 0, adapter->idx);
 
 	RET_ON_FAIL(!adapter->cmd_wq);
 
@@ -659,7 +655,7 @@ int cmd_connect_request(struct esp_wifi_device *priv,
 		printk(KERN_ERR "%s: No ssid\n", __func__);
 
 	if (params->bssid) {
-		memcpy(ap_bssid, params->bssid, MAC_ADDR_LEN);
+		memcpy(priv->ap_bssid, params->bssid, MAC_ADDR_LEN);
 		memcpy(cmd->bssid, params->bssid, MAC_ADDR_LEN);
 	}
 
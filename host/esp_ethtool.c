@@ -0,0 +1,156 @@
+/*
+ * Espressif Systems Wireless LAN device driver
+ *
+ * Copyright (C) 2015-2021 Espressif Systems (Shanghai) PTE LTD
+ *
+ * This software file (the "File") is distributed by Espressif Systems (Shanghai)
+ * PTE LTD under the terms of the GNU General Public License Version 2, June 1991
+ * (the "License").  You may use, redistribute and/or modify this File in
+ * accordance with the terms and conditions of the License, a copy of which
+ * is available by writing to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA or on the
+ * worldwide web at http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt.
+ *
+ * THE FILE IS DISTRIBUTED AS-IS, WITHOUT WARRANTY OF ANY KIND, AND THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE
+ * ARE EXPRESSLY DISCLAIMED.  The License provides additional details about
+ * this warranty disclaimer.
+ */
+#include <linux/version.h>
+#include <linux/ethtool.h>
+#include "esp.h"
+#include "esp_api.h"
+#include "esp_if.h"
+
+/* Indexed by enum esp_tx_drop_reason_e */
+static const char esp_tx_drop_strings[ESP_TX_DROP_MAX][ETH_GSTRING_LEN] = {
+	[ESP_TX_DROP_PORT_CLOSED]  = "tx_drop_port_closed",
+	[ESP_TX_DROP_BAD_LEN]      = "tx_drop_bad_len",
+	[ESP_TX_DROP_NO_HEADROOM]  = "tx_drop_no_headroom",
+	[ESP_TX_DROP_QUEUE_FULL]   = "tx_drop_queue_full",
+	[ESP_TX_DROP_TRANSPORT]    = "tx_drop_transport",
+	[ESP_TX_DROP_BUS_ERROR]    = "tx_drop_bus_error",
+};
+
+/* Adapter wide, indexed by enum esp_tx_class_e */
+static const char esp_tx_sched_strings[ESP_TX_CLASS_MAX * 2][ETH_GSTRING_LEN] = {
+	"tx_sched_internal_packets",
+	"tx_sched_hci_packets",
+	"tx_sched_data_packets",
+	"tx_sched_internal_bytes",
+	"tx_sched_hci_bytes",
+	"tx_sched_data_bytes",
+};
+
+/* Adapter wide, in order of struct esp_rx_poll_stats */
+static const char esp_rx_poll_strings[][ETH_GSTRING_LEN] = {
+	"rx_interrupts",
+	"rx_polls",
+	"rx_poll_enter",
+	"rx_poll_exit",
+};
+
+#define ESP_RX_POLL_STATS_LEN   ARRAY_SIZE(esp_rx_poll_strings)
+
+static int esp_get_sset_count(struct net_device *ndev, int sset)
+{
+	switch (sset) {
+	case ETH_SS_STATS:
+		return ESP_TX_DROP_MAX + ESP_TX_CLASS_MAX * 2 +
+			ESP_RX_POLL_STATS_LEN;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static void esp_get_strings(struct net_device *ndev, u32 sset, u8 *data)
+{
+	if (sset != ETH_SS_STATS)
+		return;
+
+	memcpy(data, esp_tx_drop_strings, sizeof(esp_tx_drop_strings));
+	data += sizeof(esp_tx_drop_strings);
+	memcpy(data, esp_tx_sched_strings, sizeof(esp_tx_sched_strings));
+	data += sizeof(esp_tx_sched_strings);
+	memcpy(data, esp_rx_poll_strings, sizeof(esp_rx_poll_strings));
+}
+
+static void esp_get_ethtool_stats(struct net_device *ndev,
+		struct ethtool_stats *stats, u64 *data)
+{
+	struct esp_wifi_device *priv = netdev_priv(ndev);
+	struct esp_tx_sched *sched = &priv->adapter->tx_sched;
+	struct esp_rx_poll_stats *rx_poll = &priv->adapter->rx_poll_stats;
+	unsigned int start;
+	int i;
+
+	for (i = 0; i < ESP_TX_DROP_MAX; i++)
+		*data++ = atomic_long_read(&priv->tx_drops[i]);
+
+	do {
+		start = u64_stats_fetch_begin(&sched->syncp);
+		for (i = 0; i < ESP_TX_CLASS_MAX; i++) {
+			data[i] = sched->tx_packets[i];
+			data[ESP_TX_CLASS_MAX + i] = sched->tx_bytes[i];
+		}
+	} while (u64_stats_fetch_retry(&sched->syncp, start));
+	data += ESP_TX_CLASS_MAX * 2;
+
+	*data++ = atomic64_read(&rx_poll->interrupts);
+	*data++ = atomic64_read(&rx_poll->polls);
+	*data++ = atomic64_read(&rx_poll->poll_enter);
+	*data++ = atomic64_read(&rx_poll->poll_exit);
+}
+
+/* Coalesce settings belong to transport, see its get/set_coalesce */
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0))
+static int esp_get_coalesce(struct net_device *ndev, struct ethtool_coalesce *ec,
+		struct kernel_ethtool_coalesce *kec, struct netlink_ext_ack *extack)
+#else
+static int esp_get_coalesce(struct net_device *ndev, struct ethtool_coalesce *ec)
+#endif
+{
+	struct esp_wifi_device *priv = netdev_priv(ndev);
+	struct esp_adapter *adapter = priv->adapter;
+
+	if (!adapter->if_ops || !adapter->if_ops->get_coalesce)
+		return -EOPNOTSUPP;
+
+	return adapter->if_ops->get_coalesce(adapter, ec);
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0))
+static int esp_set_coalesce(struct net_device *ndev, struct ethtool_coalesce *ec,
+		struct kernel_ethtool_coalesce *kec, struct netlink_ext_ack *extack)
+#else
+static int esp_set_coalesce(struct net_device *ndev, struct ethtool_coalesce *ec)
+#endif
+{
+	struct esp_wifi_device *priv = netdev_priv(ndev);
+	struct esp_adapter *adapter = priv->adapter;
+
+	if (!adapter->if_ops || !adapter->if_ops->set_coalesce)
+		return -EOPNOTSUPP;
+
+	return adapter->if_ops->set_coalesce(adapter, ec);
+}
+
+static const struct ethtool_ops esp_ethtool_ops = {
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 7, 0))
+	.supported_coalesce_params = ETHTOOL_COALESCE_RX_USECS |
+		ETHTOOL_COALESCE_RX_MAX_FRAMES |
+		ETHTOOL_COALESCE_RX_USECS_LOW |
+		ETHTOOL_COALESCE_USE_ADAPTIVE_RX,
+#endif
+	.get_link = ethtool_op_get_link,
+	.get_sset_count = esp_get_sset_count,
+	.get_strings = esp_get_strings,
+	.get_ethtool_stats = esp_get_ethtool_stats,
+	.get_coalesce = esp_get_coalesce,
+	.set_coalesce = esp_set_coalesce,
+};
+
+void esp_set_ethtool_ops(struct net_device *ndev)
+{
+	ndev->ethtool_ops = &esp_ethtool_ops;
+}
@@ -0,0 +1,172 @@
+/*
+ * Espressif Systems Wireless LAN device driver
+ *
+ * Copyright (C) 2015-2021 Espressif Systems (Shanghai) PTE LTD
+ *
+ * This software file (the "File") is distributed by Espressif Systems (Shanghai)
+ * PTE LTD under the terms of the GNU General Public License Version 2, June 1991
+ * (the "License").  You may use, redistribute and/or modify this File in
+ * accordance with the terms and conditions of the License, a copy of which
+ * is available by writing to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA or on the
+ * worldwide web at http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt.
+ *
+ * THE FILE IS DISTRIBUTED AS-IS, WITHOUT WARRANTY OF ANY KIND, AND THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE
+ * ARE EXPRESSLY DISCLAIMED.  The License provides additional details about
+ * this warranty disclaimer.
+ */
+#include <linux/module.h>
+#include <linux/skbuff.h>
+#include "esp_tx_sched.h"
+
+/*
+ * Picks next transport priority queue to serve.
+ *
+ * ESP_INTERNAL_IF frames (PRIO_Q_HIGH) always go first. HCI (PRIO_Q_MID)
+ * and Wi-Fi data (PRIO_Q_LOW onwards) share the bus by deficit round robin,
+ * each getting weight * ESP_TX_SCHED_QUANTUM bytes per round. Within data
+ * class, access categories are served strictly from AC_VO to AC_BK.
+ * Module parameter tx_sched=0 restores plain strict priority.
+ */
+
+/* Not less than largest frame of any transport, so that each backlogged
+ * class sends at least one frame per round */
+#define ESP_TX_SCHED_QUANTUM    2048
+
+enum esp_tx_sched_mode {
+	ESP_TX_SCHED_STRICT,
+	ESP_TX_SCHED_DRR,
+};
+
+static int tx_sched = ESP_TX_SCHED_DRR;
+module_param(tx_sched, int, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(tx_sched, "TX scheduler across HCI and Wi-Fi data: 0 strict priority, 1 deficit round robin");
+
+static uint hci_weight = 1;
+module_param(hci_weight, uint, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(hci_weight, "Deficit round robin weight of HCI traffic");
+
+static uint data_weight = 4;
+module_param(data_weight, uint, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(data_weight, "Deficit round robin weight of Wi-Fi data traffic");
+
+static u8 prio_to_class(u8 prio)
+{
+	if (prio == PRIO_Q_HIGH)
+		return ESP_TX_CLASS_INTERNAL;
+
+	if (prio == PRIO_Q_MID)
+		return ESP_TX_CLASS_HCI;
+
+	return ESP_TX_CLASS_DATA;
+}
+
+/* First non empty queue of class and length of its head frame */
+static u8 class_head(struct sk_buff_head *tx_q, u8 class, u32 *len)
+{
+	struct sk_buff *skb = NULL;
+	unsigned long flags;
+	u8 prio, last;
+
+	switch (class) {
+	case ESP_TX_CLASS_INTERNAL:
+		prio = last = PRIO_Q_HIGH;
+		break;
+	case ESP_TX_CLASS_HCI:
+		prio = last = PRIO_Q_MID;
+		break;
+	default:
+		prio = PRIO_Q_LOW;
+		last = MAX_PRIORITY_QUEUES - 1;
+		break;
+	}
+
+	for (; prio <= last; prio++) {
+		spin_lock_irqsave(&tx_q[prio].lock, flags);
+		skb = skb_peek(&tx_q[prio]);
+		*len = skb ? skb->len : 0;
+		spin_unlock_irqrestore(&tx_q[prio].lock, flags);
+
+		if (skb)
+			return prio;
+	}
+
+	return MAX_PRIORITY_QUEUES;
+}
+
+static u8 strict_select(struct sk_buff_head *tx_q)
+{
+	u32 len = 0;
+	u8 prio;
+
+	prio = class_head(tx_q, ESP_TX_CLASS_HCI, &len);
+	if (prio != MAX_PRIORITY_QUEUES)
+		return prio;
+
+	return class_head(tx_q, ESP_TX_CLASS_DATA, &len);
+}
+
+void esp_tx_sched_init(struct esp_tx_sched *sched)
+{
+	memset(sched, 0, sizeof(*sched));
+
+	sched->quantum[ESP_TX_CLASS_HCI] = max_t(uint, hci_weight, 1) * ESP_TX_SCHED_QUANTUM;
+	sched->quantum[ESP_TX_CLASS_DATA] = max_t(uint, data_weight, 1) * ESP_TX_SCHED_QUANTUM;
+	sched->cur = ESP_TX_CLASS_HCI;
+	sched->fresh = 1;
+	u64_stats_init(&sched->syncp);
+}
+
+/* Returns priority queue to dequeue from, MAX_PRIORITY_QUEUES if all are
+ * empty. Caller reports what it took with esp_tx_sched_charge() */
+u8 esp_tx_sched_select(struct esp_tx_sched *sched, struct sk_buff_head *tx_q)
+{
+	u8 prio, class, visits;
+	u32 len = 0;
+
+	prio = class_head(tx_q, ESP_TX_CLASS_INTERNAL, &len);
+	if (prio != MAX_PRIORITY_QUEUES)
+		return prio;
+
+	if (tx_sched == ESP_TX_SCHED_STRICT)
+		return strict_select(tx_q);
+
+	/* Quantum covers any head frame, so two rounds are always enough */
+	for (visits = 0; visits < 2 * (ESP_TX_CLASS_MAX - 1); visits++) {
+		class = sched->cur;
+		prio = class_head(tx_q, class, &len);
+
+		if (prio == MAX_PRIORITY_QUEUES) {
+			/* Idle class does not bank credit */
+			sched->deficit[class] = 0;
+		} else {
+			if (sched->fresh) {
+				sched->deficit[class] += sched->quantum[class];
+				sched->fresh = 0;
+			}
+
+			if (sched->deficit[class] >= len)
+				return prio;
+		}
+
+		sched->cur = (class == ESP_TX_CLASS_DATA) ? ESP_TX_CLASS_HCI : ESP_TX_CLASS_DATA;
+		sched->fresh = 1;
+	}
+
+	/* Not reached unless frame is larger than quantum */
+	return strict_select(tx_q);
+}
+
+void esp_tx_sched_charge(struct esp_tx_sched *sched, u8 prio, u32 len)
+{
+	u8 class = prio_to_class(prio);
+
+	if (class != ESP_TX_CLASS_INTERNAL)
+		sched->deficit[class] -= min(sched->deficit[class], len);
+
+	u64_stats_update_begin(&sched->syncp);
+	sched->tx_packets[class]++;
+	sched->tx_bytes[class] += len;
+	u64_stats_update_end(&sched->syncp);
+}
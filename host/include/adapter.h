@@ -4,10 +4,20 @@
 #ifndef __ESP_NETWORK_ADAPTER__H
 #define __ESP_NETWORK_ADAPTER__H
 
+/* WMM access categories, highest priority first */
+enum ESP_WMM_AC {
+	ESP_AC_VO,
+	ESP_AC_VI,
+	ESP_AC_BE,
+	ESP_AC_BK,
+	ESP_MAX_AC,
+};
+
 #define PRIO_Q_HIGH             0
 #define PRIO_Q_MID              1
+/* Data frames use queue PRIO_Q_LOW + access category */
 #define PRIO_Q_LOW              2
-#define MAX_PRIORITY_QUEUES     3
+#define MAX_PRIORITY_QUEUES     (PRIO_Q_LOW + ESP_MAX_AC)
 #define MAC_ADDR_LEN			6
 #define MAX_KEY_LEN             32
 #define MAX_SEQ_LEN             10
@@ -22,7 +32,8 @@ struct esp_payload_header {
 	uint8_t          if_num:4;
 	uint8_t          flags;
 	uint8_t			 packet_type;
-	uint8_t          reserved1;
+	uint8_t          wmm_ac:2;			/* enum ESP_WMM_AC, data frames only */
+	uint8_t          reserved1:6;
 	uint16_t         len;
 	uint16_t         offset;
 	uint16_t         checksum;
@@ -69,6 +80,22 @@ enum ESP_CAPABILITIES {
 	ESP_BT_SPI_SUPPORT = (1 << 6),
 };
 
+enum ESP_EXT_CAPABILITIES {
+	ESP_CHECKSUM_SKIP = (1 << 0),
+	/* SDIO: several frames per CMD53, each with own esp_payload_header.
+	 * Frames start 4 byte aligned and never cross an RX buffer of slave,
+	 * zeroed header marks end of frames in a buffer */
+	ESP_TX_AGGREGATION = (1 << 1),
+	/* SPI: payload headers of both sides are clocked first with chip
+	 * select held, then only as many bytes as longer of the two frames
+	 * needs, rounded up to 4. Chip select release ends transaction */
+	ESP_SPI_VAR_LEN = (1 << 2),
+	/* SDIO: one read may carry several frames, each with own
+	 * esp_payload_header right at its start. Next frame starts 4 byte
+	 * aligned after frame before it, zeroed header marks end of frames */
+	ESP_RX_AGGREGATION = (1 << 3),
+};
+
 enum ESP_INTERNAL_MSG {
     ESP_INTERNAL_BOOTUP_EVENT = 1,
 };
@@ -78,6 +105,7 @@ enum ESP_BOOTUP_TAG_TYPE {
 	ESP_BOOTUP_FW_DATA,
 	ESP_BOOTUP_SPI_CLK_MHZ,
 	ESP_BOOTUP_FIRMWARE_CHIP_ID,
+	ESP_BOOTUP_CAPABILITY_EXT,
 };
 
 enum COMMAND_CODE {
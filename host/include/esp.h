@@ -26,6 +26,7 @@
 #include <linux/netdevice.h>
 #include <linux/etherdevice.h>
 #include <linux/spinlock.h>
+#include <linux/u64_stats_sync.h>
 #include <net/cfg80211.h>
 #include <net/bluetooth/bluetooth.h>
 #include <net/bluetooth/hci_core.h>
@@ -33,6 +34,7 @@
 
 #define ESP_IF_TYPE_SDIO        1
 #define ESP_IF_TYPE_SPI         2
+#define ESP_IF_TYPE_LOOPBACK    3
 
 /* Network link status */
 #define ESP_LINK_DOWN           0
@@ -60,6 +62,9 @@ struct esp_adapter;
 #define ACQUIRE_LOCK            1
 #define LOCK_ALREADY_ACQUIRED   0
 
+/* Max data frames held back for one write_batch call */
+#define ESP_TX_BATCH_MAX        32
+
 #define SKB_DATA_ADDR_ALIGNMENT 4
 #define INTERFACE_HEADER_PADDING (SKB_DATA_ADDR_ALIGNMENT*3)
 
@@ -72,6 +77,52 @@ enum priv_flags_e {
 	ESP_NETWORK_UP,
 };
 
+/* Why data frame was dropped on TX, see esp_ethtool.c */
+enum esp_tx_drop_reason_e {
+	ESP_TX_DROP_PORT_CLOSED,
+	ESP_TX_DROP_BAD_LEN,
+	ESP_TX_DROP_NO_HEADROOM,
+	ESP_TX_DROP_QUEUE_FULL,
+	ESP_TX_DROP_TRANSPORT,
+	ESP_TX_DROP_BUS_ERROR,
+	ESP_TX_DROP_MAX,
+};
+
+/* Traffic classes of TX scheduler, see esp_tx_sched.c */
+enum esp_tx_class_e {
+	ESP_TX_CLASS_INTERNAL,
+	ESP_TX_CLASS_HCI,
+	ESP_TX_CLASS_DATA,
+	ESP_TX_CLASS_MAX,
+};
+
+struct esp_tx_sched {
+	u32                     quantum[ESP_TX_CLASS_MAX];
+	u32                     deficit[ESP_TX_CLASS_MAX];
+	u8                      cur;
+	u8                      fresh;
+	u64                     tx_packets[ESP_TX_CLASS_MAX];
+	u64                     tx_bytes[ESP_TX_CLASS_MAX];
+	/* Guards counters above, read by ethtool -S */
+	struct u64_stats_sync   syncp;
+};
+
+/* RX interrupt and poll counts, of transports with adaptive RX. Atomic,
+ * as interrupt handler and poll timer both write them */
+struct esp_rx_poll_stats {
+	atomic64_t              interrupts;
+	atomic64_t              polls;
+	atomic64_t              poll_enter;
+	atomic64_t              poll_exit;
+};
+
+/* TX counters of one netdev queue, written under its xmit lock */
+struct esp_tx_queue_stats {
+	u64                     packets;
+	u64                     bytes;
+	struct u64_stats_sync   syncp;
+};
+
 struct command_node {
 	struct list_head list;
 	uint8_t cmd_code;
@@ -83,11 +134,22 @@ struct esp_adapter {
 	struct device           *dev;
 	struct wiphy			*wiphy;
 
+	/* Entry in list of probed adapters, idx is unique among them */
+	struct list_head        list;
+	int                     idx;
+
 	u8                      if_type;
 	u32                     capabilities;
+	u32                     ext_capabilities;
+
+	/* Used by transport TX context only */
+	struct esp_tx_sched     tx_sched;
+	struct esp_rx_poll_stats rx_poll_stats;
 
 	/* Possible types:
-	 * struct esp_sdio_context */
+	 * struct esp_sdio_context
+	 * struct esp_spi_context
+	 * struct esp_loopback_context */
 	void                    *if_context;
 
 	struct esp_if_ops       *if_ops;
@@ -135,10 +197,18 @@ struct esp_wifi_device {
 	struct esp_adapter      *adapter;
 
 	struct net_device_stats stats;
+	/* Bumped from xmit, transport TX and work contexts alike */
+	atomic_long_t           tx_drops[ESP_TX_DROP_MAX];
+	atomic_long_t           tx_dropped;
+	struct esp_tx_queue_stats tx_stats[ESP_MAX_AC];
+	struct napi_struct      napi;
+	struct sk_buff_head     rx_q;
+	struct sk_buff_head     tx_batch[ESP_MAX_AC];
 	u8                      link_state;
 	u8                      mac_address[MAC_ADDR_LEN];
 	u8                      if_type;
 	u8                      if_num;
+	u8                      ap_bssid[MAC_ADDR_LEN];
 
 	int                     ssid_len;
 	u8                      ssid[32];
@@ -168,6 +238,17 @@ struct esp_private {
 };
 #endif
 
+/* Transport TX queue of frame, see PRIO_Q_* */
+static inline u8 esp_get_tx_prio_q(struct esp_payload_header *header)
+{
+	if (header->if_type == ESP_INTERNAL_IF)
+		return PRIO_Q_HIGH;
+	else if (header->if_type == ESP_HCI_IF)
+		return PRIO_Q_MID;
+
+	return PRIO_Q_LOW + header->wmm_ac;
+}
+
 struct esp_skb_cb {
 /*	struct esp_private      *priv;*/
 	struct esp_wifi_device      *priv;
@@ -34,13 +34,19 @@
 int esp_add_card(struct esp_adapter *adapter);
 int esp_remove_card(struct esp_adapter *adapter);
 void esp_process_new_packet_intr(struct esp_adapter *adapter);
-struct esp_adapter * esp_get_adapter(void);
-struct esp_wifi_device * get_priv_from_payload_header(struct esp_payload_header *header);
+struct esp_adapter * esp_alloc_adapter(void);
+void esp_free_adapter(struct esp_adapter *adapter);
+struct esp_wifi_device * get_priv_from_payload_header(struct esp_adapter *adapter,
+		struct esp_payload_header *header);
 struct sk_buff * esp_alloc_skb(u32 len);
 int esp_send_packet(struct esp_adapter *adapter, struct sk_buff *skb);
 u8 esp_is_bt_supported_over_sdio(u32 cap);
-void esp_tx_pause(struct esp_wifi_device *priv);
-void esp_tx_resume(struct esp_wifi_device *priv);
+void esp_tx_pause(struct esp_wifi_device *priv, u8 ac);
+void esp_tx_resume(struct esp_wifi_device *priv, u8 ac);
+void esp_tx_sent(struct esp_wifi_device *priv, u8 ac, u32 bytes);
+void esp_tx_completed(struct esp_wifi_device *priv, u8 ac, u32 packets, u32 bytes);
+void esp_tx_drop(struct esp_wifi_device *priv, u8 reason);
+void esp_set_ethtool_ops(struct net_device *ndev);
 void process_event_esp_bootup(struct esp_adapter *adapter, u8 *evt_buf, u8 len);
 int process_fw_data(struct fw_data *fw_p);
 void esp_init_priv(struct net_device *ndev);
@@ -49,5 +55,6 @@ void esp_port_close(struct esp_wifi_device * priv);
 void esp_remove_network_interfaces(struct esp_adapter *adapter);
 void print_capabilities(u32 cap);
 void process_capabilities(struct esp_adapter *adapter);
+void process_ext_capabilities(struct esp_adapter *adapter, u8 *data, u8 len);
 
 #endif
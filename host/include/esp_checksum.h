@@ -0,0 +1,33 @@
+/*
+ * Espressif Systems Wireless LAN device driver
+ *
+ * Copyright (C) 2015-2021 Espressif Systems (Shanghai) PTE LTD
+ *
+ * This software file (the "File") is distributed by Espressif Systems (Shanghai)
+ * PTE LTD under the terms of the GNU General Public License Version 2, June 1991
+ * (the "License").  You may use, redistribute and/or modify this File in
+ * accordance with the terms and conditions of the License, a copy of which
+ * is available by writing to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA or on the
+ * worldwide web at http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt.
+ *
+ * THE FILE IS DISTRIBUTED AS-IS, WITHOUT WARRANTY OF ANY KIND, AND THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE
+ * ARE EXPRESSLY DISCLAIMED.  The License provides additional details about
+ * this warranty disclaimer.
+ */
+#ifndef __esp_checksum_h_
+#define __esp_checksum_h_
+
+#include "esp.h"
+
+/* Same result as compute_checksum() in adapter.h */
+u16 esp_checksum(const u8 *buf, u32 len);
+u16 esp_compute_skb_checksum(struct sk_buff *skb);
+u8 esp_is_checksum_needed(struct esp_adapter *adapter);
+
+#ifdef CONFIG_ENABLE_CHECKSUM_BENCHMARK
+void esp_checksum_benchmark(void);
+#endif
+
+#endif
@@ -26,10 +26,21 @@ struct esp_if_ops {
 	int (*init)(struct esp_adapter *adapter);
 	struct sk_buff* (*read)(struct esp_adapter *adapter);
 	int (*write)(struct esp_adapter *adapter, struct sk_buff *skb);
+	/* Optional batch operations, bus lock is taken once per batch.
+	 * read_batch: append packets pending at transport to list, returns count.
+	 * write_batch: take packets from head of list in order, till the first
+	 *   one which can not be accepted. Packets left in list stay with caller.
+	 *   -EBUSY if transport is full, else error is about first packet left,
+	 *   and caller may pass the rest again. */
+	int (*read_batch)(struct esp_adapter *adapter, struct sk_buff_head *list);
+	int (*write_batch)(struct esp_adapter *adapter, struct sk_buff_head *list);
 	int (*deinit)(struct esp_adapter *adapter);
+	/* Optional, RX interrupt coalescing through ethtool -c/-C */
+	int (*get_coalesce)(struct esp_adapter *adapter, struct ethtool_coalesce *ec);
+	int (*set_coalesce)(struct esp_adapter *adapter, struct ethtool_coalesce *ec);
 };
 
-int esp_init_interface_layer(struct esp_adapter *adapter);
+int esp_init_interface_layer(void);
 void esp_deinit_interface_layer(void);
 
 #endif
@@ -0,0 +1,679 @@
+/*
+ * Copyright (C) 2015-2021 Espressif Systems (Shanghai) PTE LTD
+ *
+ * This software file (the "File") is distributed by Espressif Systems (Shanghai)
+ * PTE LTD under the terms of the GNU General Public License Version 2, June 1991
+ * (the "License").  You may use, redistribute and/or modify this File in
+ * accordance with the terms and conditions of the License, a copy of which
+ * is available by writing to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA or on the
+ * worldwide web at http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt.
+ *
+ * THE FILE IS DISTRIBUTED AS-IS, WITHOUT WARRANTY OF ANY KIND, AND THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE
+ * ARE EXPRESSLY DISCLAIMED.  The License provides additional details about
+ * this warranty disclaimer.
+ */
+
+/*
+ * Loopback transport
+ *
+ * Emulates ESP peripheral in software, so that host stack can be exercised
+ * and profiled without any hardware attached:
+ *  - Data frames written by host are reflected back as received frames
+ *  - Command requests are answered with synthetic success responses
+ *  - Bootup event is generated on load, like the real firmware does
+ *  - Scan reports one open BSS, which can be connected to
+ */
+#include <linux/module.h>
+#include <linux/device.h>
+#include <linux/etherdevice.h>
+#include "esp_loopback.h"
+#include "esp_if.h"
+#include "esp_api.h"
+#include "esp_bt_api.h"
+#include "esp_checksum.h"
+
+/* Netdev queue is stopped at TX_STOP_THRESHOLD, which leaves room for
+ * a TX batch already taken from stack */
+#define TX_MAX_PENDING_COUNT    200
+#define TX_STOP_THRESHOLD       (TX_MAX_PENDING_COUNT - ESP_TX_BATCH_MAX)
+#define TX_RESUME_THRESHOLD     (TX_MAX_PENDING_COUNT/5)
+
+#define WLAN_CAPABILITY_ESS_BIT 0x0001
+#define WLAN_EID_SSID_ID        0
+#define WLAN_EID_DS_PARAMS_ID   3
+#define BEACON_FIXED_PARAMS_LEN 12
+#define BEACON_INTERVAL_TU      100
+
+static struct sk_buff * read_packet(struct esp_adapter *adapter);
+static int write_packet(struct esp_adapter *adapter, struct sk_buff *skb);
+static int read_packet_batch(struct esp_adapter *adapter, struct sk_buff_head *list);
+static int write_packet_batch(struct esp_adapter *adapter, struct sk_buff_head *list);
+
+static int devices = 1;
+module_param(devices, int, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(devices, "Number of loopback ESP devices to create");
+
+static bool skip_checksum;
+module_param(skip_checksum, bool, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(skip_checksum, "Advertise ESP_CHECKSUM_SKIP in bootup event");
+
+static LIST_HEAD(loopback_devices);
+
+static struct esp_if_ops if_ops = {
+	.read		= read_packet,
+	.write		= write_packet,
+	.read_batch	= read_packet_batch,
+	.write_batch	= write_packet_batch,
+};
+
+static void queue_rx_packet(struct esp_loopback_context *context,
+		struct sk_buff *skb)
+{
+	atomic_inc(&context->rx_pending);
+	skb_queue_tail(&context->rx_q, skb);
+
+	/* indicate reception of new packet */
+	esp_process_new_packet_intr(context->adapter);
+}
+
+static u8 * alloc_rx_frame(struct sk_buff **skb_out, u8 if_type, u8 if_num,
+		u8 packet_type, u16 len)
+{
+	struct esp_payload_header *header;
+	struct sk_buff *skb;
+	u16 total_len = len + sizeof(struct esp_payload_header);
+
+	skb = esp_alloc_skb(total_len);
+	if (!skb) {
+		printk(KERN_ERR "%s: SKB alloc failed\n", __func__);
+		return NULL;
+	}
+
+	header = skb_put(skb, total_len);
+	memset(header, 0, total_len);
+
+	header->if_type = if_type;
+	header->if_num = if_num;
+	header->packet_type = packet_type;
+	header->len = cpu_to_le16(len);
+	header->offset = cpu_to_le16(sizeof(struct esp_payload_header));
+
+	*skb_out = skb;
+
+	return skb->data + sizeof(struct esp_payload_header);
+}
+
+static void send_event(struct esp_loopback_context *context,
+		struct esp_payload_header *req, u8 event_code, u8 status, u16 len,
+		const void *data)
+{
+	struct event_header *evt;
+	struct sk_buff *skb = NULL;
+
+	evt = (struct event_header *) alloc_rx_frame(&skb, req->if_type,
+			req->if_num, PACKET_TYPE_EVENT, len);
+	if (!evt)
+		return;
+
+	/* event specific fields follow common event header */
+	if (data)
+		memcpy(evt, data, len);
+
+	evt->event_code = event_code;
+	evt->status = status;
+	evt->len = cpu_to_le16(len - sizeof(struct event_header));
+
+	queue_rx_packet(context, skb);
+}
+
+static void send_scan_result(struct esp_loopback_context *context,
+		struct esp_payload_header *req)
+{
+	u16 ssid_len = strlen(LOOPBACK_SSID);
+	u16 frame_len = BEACON_FIXED_PARAMS_LEN + 2 + ssid_len + 2 + 1;
+	u16 len = sizeof(struct scan_event) + frame_len;
+	struct scan_event *evt;
+	u8 *pos;
+
+	evt = kzalloc(len, GFP_KERNEL);
+	if (!evt)
+		return;
+
+	memcpy(evt->bssid, context->bssid, MAC_ADDR_LEN);
+	evt->channel = LOOPBACK_CHANNEL;
+	evt->rssi = cpu_to_le32(LOOPBACK_RSSI_MBM);
+	evt->frame_len = cpu_to_le16(frame_len);
+
+	/* Beacon fixed parameters: timestamp, beacon interval, capabilities */
+	pos = evt->frame + 8;
+	*pos++ = BEACON_INTERVAL_TU & 0xff;
+	*pos++ = BEACON_INTERVAL_TU >> 8;
+	*pos++ = WLAN_CAPABILITY_ESS_BIT & 0xff;
+	*pos++ = WLAN_CAPABILITY_ESS_BIT >> 8;
+
+	*pos++ = WLAN_EID_SSID_ID;
+	*pos++ = ssid_len;
+	memcpy(pos, LOOPBACK_SSID, ssid_len);
+	pos += ssid_len;
+
+	*pos++ = WLAN_EID_DS_PARAMS_ID;
+	*pos++ = 1;
+	*pos++ = LOOPBACK_CHANNEL;
+
+	/* Non zero status indicates scan result, zero indicates scan done */
+	send_event(context, req, EVENT_SCAN_RESULT, 1, len, evt);
+	kfree(evt);
+
+	send_event(context, req, EVENT_SCAN_RESULT, 0,
+			sizeof(struct scan_event), NULL);
+}
+
+static void send_connect_event(struct esp_loopback_context *context,
+		struct esp_payload_header *req, struct cmd_sta_connect *cmd)
+{
+	struct connect_event evt = {0};
+
+	memcpy(evt.ssid, cmd->ssid, MAX_SSID_LEN);
+	memcpy(evt.bssid, context->bssid, MAC_ADDR_LEN);
+	evt.channel = LOOPBACK_CHANNEL;
+
+	send_event(context, req, EVENT_STA_CONNECT, 0, sizeof(evt), &evt);
+}
+
+static void send_disconnect_event(struct esp_loopback_context *context,
+		struct esp_payload_header *req, struct cmd_sta_disconnect *cmd)
+{
+	struct disconnect_event evt = {0};
+
+	strscpy(evt.ssid, LOOPBACK_SSID, sizeof(evt.ssid));
+	memcpy(evt.bssid, context->bssid, MAC_ADDR_LEN);
+	evt.reason = cmd->reason_code;
+
+	send_event(context, req, EVENT_STA_DISCONNECT, 0, sizeof(evt), &evt);
+}
+
+static void process_command_request(struct esp_loopback_context *context,
+		struct sk_buff *req_skb)
+{
+	struct esp_payload_header *req = (struct esp_payload_header *) req_skb->data;
+	struct command_header *cmd;
+	struct command_header *resp;
+	struct cmd_config_mac_address *mac_resp;
+	struct sk_buff *skb = NULL;
+	u16 resp_len = sizeof(struct command_header);
+
+	cmd = (struct command_header *) (req_skb->data + le16_to_cpu(req->offset));
+
+	if (cmd->cmd_code == CMD_GET_MAC)
+		resp_len = sizeof(struct cmd_config_mac_address);
+
+	resp = (struct command_header *) alloc_rx_frame(&skb, req->if_type,
+			req->if_num, PACKET_TYPE_COMMAND_RESPONSE, resp_len);
+	if (!resp)
+		return;
+
+	resp->cmd_code = cmd->cmd_code;
+	resp->seq_num = cmd->seq_num;
+	resp->len = cpu_to_le16(resp_len);
+
+	if (cmd->cmd_code > 0 && cmd->cmd_code < CMD_MAX)
+		resp->cmd_status = CMD_RESPONSE_SUCCESS;
+	else
+		resp->cmd_status = CMD_RESPONSE_UNSUPPORTED;
+
+	if (cmd->cmd_code == CMD_GET_MAC) {
+		mac_resp = (struct cmd_config_mac_address *) resp;
+		memcpy(mac_resp->mac_addr, context->mac_address, MAC_ADDR_LEN);
+	}
+
+	queue_rx_packet(context, skb);
+
+	/* Events triggered by command follow its response */
+	switch (cmd->cmd_code) {
+
+	case CMD_SCAN_REQUEST:
+		send_scan_result(context, req);
+		break;
+
+	case CMD_STA_CONNECT:
+		send_connect_event(context, req, (struct cmd_sta_connect *) cmd);
+		break;
+
+	case CMD_STA_DISCONNECT:
+		send_disconnect_event(context, req, (struct cmd_sta_disconnect *) cmd);
+		break;
+
+	default:
+		break;
+	}
+}
+
+static int reflect_data_packet(struct esp_loopback_context *context,
+		struct sk_buff *skb)
+{
+	struct esp_payload_header *header = (struct esp_payload_header *) skb->data;
+	u16 offset = le16_to_cpu(header->offset);
+	u16 rx_checksum, checksum;
+	struct ethhdr *eth;
+
+	if (skb_ensure_writable(skb, offset + ETH_HLEN))
+		return -ENOMEM;
+
+	header = (struct esp_payload_header *) skb->data;
+
+	/* Verify checksum, the way firmware does */
+	rx_checksum = le16_to_cpu(header->checksum);
+	header->checksum = 0;
+
+	if (rx_checksum) {
+		/* Frame may carry paged frags, see NETIF_F_SG */
+		checksum = esp_compute_skb_checksum(skb);
+
+		if (checksum != rx_checksum)
+			context->checksum_errors++;
+	}
+
+	/* Frame is received by same interface it is sent from */
+	eth = (struct ethhdr *) (skb->data + offset);
+	memcpy(eth->h_source, eth->h_dest, MAC_ADDR_LEN);
+	memcpy(eth->h_dest, context->mac_address, MAC_ADDR_LEN);
+
+	/* Drop socket, dst and conntrack references of TX path */
+	skb_scrub_packet(skb, true);
+
+	queue_rx_packet(context, skb);
+
+	return 0;
+}
+
+/* Reflect queue is shared, so every access category waits on it.
+ * esp_tx_resume() wakes only queues which are stopped */
+static void resume_tx_queues(struct esp_adapter *adapter)
+{
+	uint8_t iface_idx = 0;
+	u8 ac;
+
+	for (iface_idx=0; iface_idx < ESP_MAX_INTERFACE; iface_idx++)
+		for (ac = 0; ac < ESP_MAX_AC; ac++)
+			esp_tx_resume(adapter->priv[iface_idx], ac);
+}
+
+static struct sk_buff * read_packet(struct esp_adapter *adapter)
+{
+	struct esp_loopback_context *context;
+	struct sk_buff *skb;
+
+	if (!adapter || !adapter->if_context) {
+		printk (KERN_ERR "%s: Invalid args\n", __func__);
+		return NULL;
+	}
+
+	context = adapter->if_context;
+
+	if (!context->data_path)
+		return NULL;
+
+	skb = skb_dequeue(&context->rx_q);
+
+	if (!skb)
+		return NULL;
+
+	/* resume network tx queue if bearable load */
+	if (atomic_dec_return(&context->rx_pending) <= TX_RESUME_THRESHOLD)
+		resume_tx_queues(adapter);
+
+	return skb;
+}
+
+static int read_packet_batch(struct esp_adapter *adapter, struct sk_buff_head *list)
+{
+	struct esp_loopback_context *context;
+	unsigned long flags;
+	int count, pending;
+
+	if (!adapter || !adapter->if_context || !list) {
+		printk (KERN_ERR "%s: Invalid args\n", __func__);
+		return -EINVAL;
+	}
+
+	context = adapter->if_context;
+
+	if (!context->data_path)
+		return 0;
+
+	spin_lock_irqsave(&context->rx_q.lock, flags);
+	count = skb_queue_len(&context->rx_q);
+	skb_queue_splice_tail_init(&context->rx_q, list);
+	spin_unlock_irqrestore(&context->rx_q.lock, flags);
+
+	if (!count)
+		return 0;
+
+	pending = atomic_sub_return(count, &context->rx_pending);
+
+	/* resume network tx queue if bearable load */
+	if (pending <= TX_RESUME_THRESHOLD)
+		resume_tx_queues(adapter);
+
+	return count;
+}
+
+static int write_packet(struct esp_adapter *adapter, struct sk_buff *skb)
+{
+	u32 max_pkt_size = LOOPBACK_BUF_SIZE - sizeof(struct esp_payload_header);
+	struct esp_payload_header *payload_header = NULL;
+	struct esp_loopback_context *context;
+	struct esp_skb_cb *cb = NULL;
+
+	if (!adapter || !adapter->if_context || !skb || !skb->data || !skb->len) {
+		printk (KERN_ERR "%s: Invalid args\n", __func__);
+		if(skb) {
+			dev_kfree_skb_any(skb);
+			skb = NULL;
+		}
+		return -EINVAL;
+	}
+
+	context = adapter->if_context;
+	payload_header = (struct esp_payload_header *) skb->data;
+
+	if (skb->len > max_pkt_size) {
+		printk (KERN_ERR "%s: Drop pkt of len[%u] > max loopback transport len[%u]\n",
+				__func__, skb->len, max_pkt_size);
+		dev_kfree_skb_any(skb);
+		return -EPERM;
+	}
+
+	if (!context->data_path) {
+		dev_kfree_skb_any(skb);
+		return -EPERM;
+	}
+
+	if (payload_header->packet_type == PACKET_TYPE_COMMAND_REQUEST) {
+		process_command_request(context, skb);
+		dev_kfree_skb_any(skb);
+		return 0;
+	}
+
+	if (payload_header->if_type != ESP_STA_IF &&
+	    payload_header->if_type != ESP_AP_IF) {
+		/* Nothing to answer for HCI and internal frames */
+		dev_kfree_skb_any(skb);
+		return 0;
+	}
+
+	cb = (struct esp_skb_cb *)skb->cb;
+	if (cb && cb->priv) {
+		if (atomic_read(&context->rx_pending) >= TX_MAX_PENDING_COUNT) {
+			/* Not expected, netdev queue is stopped well before */
+			esp_tx_pause(cb->priv, payload_header->wmm_ac);
+			dev_kfree_skb_any(skb);
+			skb = NULL;
+			return -EBUSY;
+		}
+
+		/* Stop before reflected frame is visible to read_packet */
+		if (atomic_read(&context->rx_pending) + 1 >= TX_STOP_THRESHOLD)
+			esp_tx_pause(cb->priv, payload_header->wmm_ac);
+	}
+
+	if (reflect_data_packet(context, skb)) {
+		dev_kfree_skb_any(skb);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static int write_packet_batch(struct esp_adapter *adapter, struct sk_buff_head *list)
+{
+	struct esp_payload_header *payload_header = NULL;
+	struct esp_loopback_context *context;
+	struct esp_skb_cb *cb = NULL;
+	struct sk_buff *skb;
+
+	if (!adapter || !adapter->if_context || !list) {
+		printk (KERN_ERR "%s: Invalid args\n", __func__);
+		return -EINVAL;
+	}
+
+	context = adapter->if_context;
+
+	while ((skb = skb_peek(list))) {
+		/* Leave rest of the batch with caller once RX side is full */
+		cb = (struct esp_skb_cb *)skb->cb;
+		if (cb && cb->priv && (atomic_read(&context->rx_pending) >= TX_MAX_PENDING_COUNT)) {
+			payload_header = (struct esp_payload_header *) skb->data;
+			esp_tx_pause(cb->priv, payload_header->wmm_ac);
+			return -EBUSY;
+		}
+
+		__skb_unlink(skb, list);
+
+		/* Frame is consumed by write_packet, also on failure */
+		write_packet(adapter, skb);
+	}
+
+	return 0;
+}
+
+static int send_bootup_event(struct esp_loopback_context *context)
+{
+	struct esp_internal_bootup_event *evt;
+	struct fw_data fw_p = {0};
+	struct sk_buff *skb = NULL;
+	__le32 ext_cap = cpu_to_le32(ESP_CHECKSUM_SKIP);
+	u8 tlv_len;
+	u8 *pos;
+
+	tlv_len = (2 + 1) + (2 + sizeof(struct fw_data)) + (2 + 1);
+
+	if (skip_checksum)
+		tlv_len += 2 + sizeof(ext_cap);
+
+	evt = (struct esp_internal_bootup_event *) alloc_rx_frame(&skb,
+			ESP_INTERNAL_IF, 0, PACKET_TYPE_EVENT,
+			sizeof(struct esp_internal_bootup_event) + tlv_len);
+	if (!evt)
+		return -ENOMEM;
+
+	evt->header.event_code = ESP_INTERNAL_BOOTUP_EVENT;
+	evt->header.status = 0;
+	evt->header.len = cpu_to_le16(tlv_len + 1);
+	evt->len = tlv_len;
+
+	pos = evt->data;
+
+	*pos++ = ESP_BOOTUP_CAPABILITY;
+	*pos++ = 1;
+	*pos++ = 0;
+
+	fw_p.version.major1 = 1;
+	fw_p.last_reset_reason = cpu_to_le32(1);
+
+	*pos++ = ESP_BOOTUP_FW_DATA;
+	*pos++ = sizeof(struct fw_data);
+	memcpy(pos, &fw_p, sizeof(struct fw_data));
+	pos += sizeof(struct fw_data);
+
+	*pos++ = ESP_BOOTUP_FIRMWARE_CHIP_ID;
+	*pos++ = 1;
+	*pos++ = ESP_FIRMWARE_CHIP_ESP32;
+
+	if (skip_checksum) {
+		*pos++ = ESP_BOOTUP_CAPABILITY_EXT;
+		*pos++ = sizeof(ext_cap);
+		memcpy(pos, &ext_cap, sizeof(ext_cap));
+		pos += sizeof(ext_cap);
+	}
+
+	queue_rx_packet(context, skb);
+
+	return 0;
+}
+
+void process_event_esp_bootup(struct esp_adapter *adapter, u8 *evt_buf, u8 len)
+{
+	u8 len_left = len, tag_len;
+	u8 *pos;
+
+	if (!adapter)
+		return;
+
+	if (!evt_buf)
+		return;
+
+	pos = evt_buf;
+
+	while (len_left) {
+		tag_len = *(pos + 1);
+
+		printk(KERN_INFO "EVENT: %d\n", *pos);
+
+		if (*pos == ESP_BOOTUP_CAPABILITY) {
+
+			adapter->capabilities = *(pos + 2);
+			process_capabilities(adapter);
+			print_capabilities(*(pos + 2));
+
+		} else if (*pos == ESP_BOOTUP_FIRMWARE_CHIP_ID) {
+
+			printk(KERN_INFO "ESP chipset emulated by loopback transport\n");
+
+		} else if (*pos == ESP_BOOTUP_CAPABILITY_EXT) {
+
+			process_ext_capabilities(adapter, pos + 2, tag_len);
+
+		} else if (*pos == ESP_BOOTUP_FW_DATA) {
+
+			if (tag_len != sizeof(struct fw_data))
+				printk(KERN_INFO "Length not matching to firmware data size\n");
+			else
+				if (process_fw_data((struct fw_data*)(pos + 2)))
+					return;
+
+		} else {
+			printk (KERN_WARNING "Unsupported tag in event");
+		}
+
+		pos += (tag_len+2);
+		len_left -= (tag_len+2);
+	}
+
+	if (esp_add_card(adapter)) {
+		printk(KERN_ERR "network iterface init failed\n");
+	}
+}
+
+static void remove_loopback_device(struct esp_loopback_context *context)
+{
+	context->data_path = CLOSE_DATAPATH;
+
+	if (context->adapter) {
+		if (context->adapter->if_rx_workqueue)
+			flush_workqueue(context->adapter->if_rx_workqueue);
+
+		esp_remove_card(context->adapter);
+
+		if (context->adapter->hcidev)
+			esp_deinit_bt(context->adapter);
+
+		esp_free_adapter(context->adapter);
+		context->adapter = NULL;
+	}
+
+	skb_queue_purge(&context->rx_q);
+
+	if (context->checksum_errors)
+		printk(KERN_INFO "%s: %u TX checksum errors detected\n", __func__,
+				context->checksum_errors);
+
+	if (context->dev)
+		root_device_unregister(context->dev);
+
+	kfree(context);
+}
+
+static int add_loopback_device(void)
+{
+	struct esp_loopback_context *context = NULL;
+	struct esp_adapter *adapter = NULL;
+	char name[LOOPBACK_NAME_LEN];
+	int ret = 0;
+
+	context = kzalloc(sizeof(struct esp_loopback_context), GFP_KERNEL);
+
+	if (!context)
+		return -ENOMEM;
+
+	skb_queue_head_init(&context->rx_q);
+	atomic_set(&context->rx_pending, 0);
+	eth_random_addr(context->mac_address);
+	eth_random_addr(context->bssid);
+
+	adapter = esp_alloc_adapter();
+
+	if (!adapter) {
+		kfree(context);
+		return -ENOMEM;
+	}
+
+	context->adapter = adapter;
+
+	snprintf(name, sizeof(name), "esp32_loop%d", adapter->idx);
+	context->dev = root_device_register(name);
+	if (IS_ERR(context->dev)) {
+		ret = PTR_ERR(context->dev);
+		context->dev = NULL;
+		remove_loopback_device(context);
+		return ret;
+	}
+
+	adapter->if_context = context;
+	adapter->if_ops = &if_ops;
+	adapter->if_type = ESP_IF_TYPE_LOOPBACK;
+	adapter->dev = context->dev;
+
+	context->data_path = OPEN_DATAPATH;
+
+	printk(KERN_INFO "%s: ESP loopback device %s registered\n", __func__, name);
+
+	ret = send_bootup_event(context);
+	if (ret) {
+		remove_loopback_device(context);
+		return ret;
+	}
+
+	list_add_tail(&context->list, &loopback_devices);
+
+	return 0;
+}
+
+int esp_init_interface_layer(void)
+{
+	int ret = 0;
+	int i = 0;
+
+	for (i = 0; i < devices; i++) {
+		ret = add_loopback_device();
+
+		if (ret) {
+			esp_deinit_interface_layer();
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+void esp_deinit_interface_layer(void)
+{
+	struct esp_loopback_context *context = NULL, *tmp = NULL;
+
+	list_for_each_entry_safe(context, tmp, &loopback_devices, list) {
+		list_del(&context->list);
+		remove_loopback_device(context);
+	}
+}
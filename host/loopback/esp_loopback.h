@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2015-2021 Espressif Systems (Shanghai) PTE LTD
+ *
+ * This software file (the "File") is distributed by Espressif Systems (Shanghai)
+ * PTE LTD under the terms of the GNU General Public License Version 2, June 1991
+ * (the "License").  You may use, redistribute and/or modify this File in
+ * accordance with the terms and conditions of the License, a copy of which
+ * is available by writing to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA or on the
+ * worldwide web at http://www.gnu.org/licenses/old-licenses/gpl-2.0.txt.
+ *
+ * THE FILE IS DISTRIBUTED AS-IS, WITHOUT WARRANTY OF ANY KIND, AND THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY OR FITNESS FOR A PARTICULAR PURPOSE
+ * ARE EXPRESSLY DISCLAIMED.  The License provides additional details about
+ * this warranty disclaimer.
+ */
+#ifndef _ESP_LOOPBACK_H_
+#define _ESP_LOOPBACK_H_
+
+#include "esp.h"
+
+#define LOOPBACK_BUF_SIZE           1600
+#define LOOPBACK_SSID               "esp_loopback"
+#define LOOPBACK_CHANNEL            6
+#define LOOPBACK_RSSI_MBM           (-4000)
+#define LOOPBACK_NAME_LEN           16
+
+struct esp_loopback_context {
+	struct list_head            list;
+	struct esp_adapter          *adapter;
+	struct device               *dev;
+	struct sk_buff_head         rx_q;
+	atomic_t                    rx_pending;
+	u8                          mac_address[MAC_ADDR_LEN];
+	u8                          bssid[MAC_ADDR_LEN];
+	u32                         checksum_errors;
+	volatile u8                 data_path;
+};
+
+enum {
+	CLOSE_DATAPATH,
+	OPEN_DATAPATH,
+};
+
+#endif
@@ -27,6 +27,8 @@
 #include "esp_bt_api.h"
 #include "esp_api.h"
 #include "esp_cmd.h"
+#include "esp_checksum.h"
+#include "esp_tx_sched.h"
 
 #include "esp_cfg80211.h"
 
@@ -40,28 +42,165 @@
     #error "No symbol **ndo_tx_timeout** found in kernel < 2.6.29"
 #endif
 
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0))
+    #define NDO_SELECT_QUEUE_PROTOTYPE() \
+        static u16 esp_select_queue(struct net_device *ndev, struct sk_buff *skb, \
+                struct net_device *sb_dev)
+#elif (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0))
+    #define NDO_SELECT_QUEUE_PROTOTYPE() \
+        static u16 esp_select_queue(struct net_device *ndev, struct sk_buff *skb, \
+                struct net_device *sb_dev, select_queue_fallback_t fallback)
+#elif (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 14, 0))
+    #define NDO_SELECT_QUEUE_PROTOTYPE() \
+        static u16 esp_select_queue(struct net_device *ndev, struct sk_buff *skb, \
+                void *accel_priv, select_queue_fallback_t fallback)
+#elif (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 13, 0))
+    #define NDO_SELECT_QUEUE_PROTOTYPE() \
+        static u16 esp_select_queue(struct net_device *ndev, struct sk_buff *skb, \
+                void *accel_priv)
+#else
+    #define NDO_SELECT_QUEUE_PROTOTYPE() \
+        static u16 esp_select_queue(struct net_device *ndev, struct sk_buff *skb)
+#endif
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0))
+    #define NDO_GET_STATS64_PROTOTYPE() \
+        static void esp_get_stats64(struct net_device *ndev, \
+                struct rtnl_link_stats64 *stats)
+    #define NDO_GET_STATS64_RETURN(stats) return
+#else
+    #define NDO_GET_STATS64_PROTOTYPE() \
+        static struct rtnl_link_stats64 *esp_get_stats64(struct net_device *ndev, \
+                struct rtnl_link_stats64 *stats)
+    #define NDO_GET_STATS64_RETURN(stats) return (stats)
+#endif
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 14, 0))
+    #define ESP_CLASSIFY_8021D(skb) cfg80211_classify8021d(skb, NULL)
+#else
+    #define ESP_CLASSIFY_8021D(skb) cfg80211_classify8021d(skb)
+#endif
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0))
+    #define ESP_NETIF_NAPI_ADD(ndev, napi, poll) \
+        netif_napi_add(ndev, napi, poll)
+#else
+    #define ESP_NETIF_NAPI_ADD(ndev, napi, poll) \
+        netif_napi_add(ndev, napi, poll, NAPI_POLL_WEIGHT)
+#endif
+
+/* Max data frames waiting for NAPI poll, per interface */
+#define ESP_RX_Q_MAX_LEN        1000
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0))
+    #define ESP_XMIT_MORE(skb)  netdev_xmit_more()
+#elif (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 18, 0))
+    #define ESP_XMIT_MORE(skb)  ((skb)->xmit_more)
+#else
+    #define ESP_XMIT_MORE(skb)  0
+#endif
+
 #define HOST_GPIO_PIN_INVALID -1
 static int resetpin = HOST_GPIO_PIN_INVALID;
-extern u8 ap_bssid[MAC_ADDR_LEN];
+
+#define ESP_RX_BUDGET_DEFAULT   64
+static int rx_budget = ESP_RX_BUDGET_DEFAULT;
 
 module_param(resetpin, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
 MODULE_PARM_DESC(resetpin, "Host's GPIO pin number which is connected to ESP32's EN to reset ESP32 device");
 
-static void deinit_adapter(void);
+module_param(rx_budget, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(rx_budget, "Max packets read from transport per RX work invocation");
+
+/* 802.1d user priority to WMM access category, as in IEEE 802.11 Table 10-1 */
+static const u8 esp_8021d_to_ac[8] = {
+	ESP_AC_BE,
+	ESP_AC_BK,
+	ESP_AC_BK,
+	ESP_AC_BE,
+	ESP_AC_VI,
+	ESP_AC_VI,
+	ESP_AC_VO,
+	ESP_AC_VO,
+};
 
+/* All adapters probed by transport layer */
+static LIST_HEAD(adapter_list);
+static DEFINE_MUTEX(adapter_list_lock);
 
-struct esp_adapter adapter;
-/*struct esp_device esp_dev;*/
+void esp_process_new_packet_intr(struct esp_adapter *adapter)
+{
+	if(adapter)
+		queue_work(adapter->if_rx_workqueue, &adapter->if_rx_work);
+}
 
-struct esp_adapter * esp_get_adapter(void)
+/* Batch of each access category is serialized by lock of its netdev queue */
+static void esp_flush_tx_batch(struct esp_wifi_device *priv, u8 ac)
 {
-	return &adapter;
+	struct esp_adapter *adapter = priv->adapter;
+	struct sk_buff_head *batch = &priv->tx_batch[ac];
+	struct sk_buff *skb = NULL;
+	u32 packets = 0, bytes = 0, len = 0;
+	int ret = 0;
+
+	if (skb_queue_empty(batch))
+		return;
+
+	if (adapter->if_ops && adapter->if_ops->write_batch) {
+		packets = skb_queue_len(batch);
+		skb_queue_walk(batch, skb)
+			bytes += skb->len;
+
+		while (!skb_queue_empty(batch)) {
+			ret = adapter->if_ops->write_batch(adapter, batch);
+
+			if (ret == -EBUSY)
+				break;
+
+			/* Only frame at head is rejected, rest of batch goes again */
+			skb = __skb_dequeue(batch);
+			if (skb) {
+				packets--;
+				bytes -= skb->len;
+				esp_tx_drop(priv, ESP_TX_DROP_TRANSPORT);
+				dev_kfree_skb_any(skb);
+			}
+		}
+
+		/* Transport is full, frames left in batch are dropped */
+		while ((skb = __skb_dequeue(batch))) {
+			packets--;
+			bytes -= skb->len;
+			esp_tx_drop(priv, ESP_TX_DROP_QUEUE_FULL);
+			dev_kfree_skb_any(skb);
+		}
+	} else {
+		while ((skb = __skb_dequeue(batch))) {
+			len = skb->len;
+
+			ret = esp_send_packet(adapter, skb);
+			if (ret) {
+				esp_tx_drop(priv, (ret == -EBUSY) ?
+						ESP_TX_DROP_QUEUE_FULL : ESP_TX_DROP_TRANSPORT);
+			} else {
+				packets++;
+				bytes += len;
+			}
+		}
+	}
+
+	u64_stats_update_begin(&priv->tx_stats[ac].syncp);
+	priv->tx_stats[ac].packets += packets;
+	priv->tx_stats[ac].bytes += bytes;
+	u64_stats_update_end(&priv->tx_stats[ac].syncp);
 }
 
-void esp_process_new_packet_intr(struct esp_adapter *adapter)
+static void esp_purge_tx_batch(struct esp_wifi_device *priv)
 {
-	if(adapter)
-		queue_work(adapter->if_rx_workqueue, &adapter->if_rx_work);
+	u8 ac;
+
+	for (ac = 0; ac < ESP_MAX_AC; ac++)
+		skb_queue_purge(&priv->tx_batch[ac]);
 }
 
 static int process_tx_packet (struct sk_buff *skb)
@@ -69,13 +208,12 @@ static int process_tx_packet (struct sk_buff *skb)
 	struct esp_wifi_device *priv = NULL;
 	struct esp_skb_cb *cb = NULL;
 	struct esp_payload_header *payload_header = NULL;
-	struct sk_buff *new_skb = NULL;
-	int ret = 0;
-	u8 pad_len = 0, realloc_skb = 0;
+	u8 pad_len = 0;
 	u16 len = 0;
 	u16 total_len = 0;
 	static u8 c = 0;
-	u8 *pos = NULL;
+	bool more = ESP_XMIT_MORE(skb);
+	u8 ac = skb_get_queue_mapping(skb);
 
 	c++;
 	/* Get the priv */
@@ -88,8 +226,9 @@ static int process_tx_packet (struct sk_buff *skb)
 		return NETDEV_TX_OK;
 	}
 
-	if (netif_queue_stopped((const struct net_device *) priv->ndev)) {
-		printk(KERN_INFO "%s: Netif queue stopped\n", __func__);
+	if (__netif_subqueue_stopped(priv->ndev, ac)) {
+		printk(KERN_INFO "%s: Netif queue %u stopped\n", __func__, ac);
+		esp_flush_tx_batch(priv, ac);
 		return NETDEV_TX_BUSY;
 	}
 
@@ -103,43 +242,17 @@ static int process_tx_packet (struct sk_buff *skb)
 	/* Align buffer length */
 	pad_len += SKB_DATA_ADDR_ALIGNMENT - (total_len % SKB_DATA_ADDR_ALIGNMENT);
 
-	if (skb_headroom(skb) < pad_len) {
-		/* Headroom is not sufficient */
-		realloc_skb = 1;
+	/* Header is pushed in place. Only the head gets copied when it is
+	 * cloned or short of headroom, paged data stays in frags and is
+	 * gathered by transport */
+	if (skb_cow_head(skb, pad_len)) {
+		printk(KERN_ERR "%s: Failed to expand SKB head", __func__);
+		esp_tx_drop(priv, ESP_TX_DROP_NO_HEADROOM);
+		dev_kfree_skb(skb);
+		return NETDEV_TX_OK;
 	}
 
-	if (realloc_skb || !IS_ALIGNED((unsigned long) skb->data, SKB_DATA_ADDR_ALIGNMENT)) {
-		/* Realloc SKB */
-		if (skb_linearize(skb)) {
-			priv->stats.tx_errors++;
-			dev_kfree_skb(skb);
-			printk(KERN_ERR "%s: Failed to linearize SKB", __func__);
-			return NETDEV_TX_OK;
-		}
-
-		new_skb = esp_alloc_skb(skb->len + pad_len);
-
-		if (!new_skb) {
-			printk(KERN_ERR "%s: Failed to allocate SKB", __func__);
-			priv->stats.tx_errors++;
-			dev_kfree_skb(skb);
-			return NETDEV_TX_OK;
-		}
-
-		pos = new_skb->data;
-		pos += pad_len;
-
-		/* Populate new SKB */
-		skb_copy_from_linear_data(skb, pos, skb->len);
-		skb_put(new_skb, skb->len + pad_len);
-
-		/* Replace old SKB */
-		dev_kfree_skb_any(skb);
-		skb = new_skb;
-	} else {
-		/* Realloc is not needed, Make space for interface header */
-		skb_push(skb, pad_len);
-	}
+	skb_push(skb, pad_len);
 
 	/* Set payload header */
 	payload_header = (struct esp_payload_header *) skb->data;
@@ -150,22 +263,22 @@ static int process_tx_packet (struct sk_buff *skb)
 	payload_header->len = cpu_to_le16(len);
 	payload_header->offset = cpu_to_le16(pad_len);
 	payload_header->packet_type = PACKET_TYPE_DATA;
+	payload_header->wmm_ac = ac;
 
-	payload_header->checksum = cpu_to_le16(compute_checksum(skb->data, (len + pad_len)));
+	if (esp_is_checksum_needed(priv->adapter))
+		payload_header->checksum = cpu_to_le16(esp_compute_skb_checksum(skb));
 
 	if (!priv->stop_data) {
-		ret = esp_send_packet(priv->adapter, skb);
+		/* Hold frame back while stack has more to send, so that
+		 * transport gets whole burst in one write_batch call */
+		__skb_queue_tail(&priv->tx_batch[ac], skb);
 
-		if (ret) {
-/*			printk(KERN_ERR "%s: Failed to send SKB", __func__);*/
-			priv->stats.tx_errors++;
-		} else {
-			priv->stats.tx_packets++;
-			priv->stats.tx_bytes += skb->len;
-		}
+		if (!more || skb_queue_len(&priv->tx_batch[ac]) >= ESP_TX_BATCH_MAX)
+			esp_flush_tx_batch(priv, ac);
 	} else {
 		dev_kfree_skb_any(skb);
-		priv->stats.tx_dropped++;
+		esp_tx_drop(priv, ESP_TX_DROP_PORT_CLOSED);
+		esp_flush_tx_batch(priv, ac);
 	}
 
 	return 0;
@@ -229,6 +342,34 @@ void process_capabilities(struct esp_adapter *adapter)
 	}
 }
 
+void process_ext_capabilities(struct esp_adapter *adapter, u8 *data, u8 len)
+{
+	__le32 ext_cap = 0;
+
+	if (len > sizeof(ext_cap)) {
+		printk(KERN_ERR "%s: Invalid ext capability length %u\n", __func__, len);
+		return;
+	}
+
+	memcpy(&ext_cap, data, len);
+	adapter->ext_capabilities = le32_to_cpu(ext_cap);
+
+	printk(KERN_INFO "ESP peripheral ext capabilities: 0x%x\n",
+			adapter->ext_capabilities);
+
+	if (adapter->ext_capabilities & ESP_CHECKSUM_SKIP)
+		printk(KERN_INFO "\t * Payload checksum disabled\n");
+
+	if (adapter->ext_capabilities & ESP_TX_AGGREGATION)
+		printk(KERN_INFO "\t * TX aggregation\n");
+
+	if (adapter->ext_capabilities & ESP_SPI_VAR_LEN)
+		printk(KERN_INFO "\t * SPI variable length transfers\n");
+
+	if (adapter->ext_capabilities & ESP_RX_AGGREGATION)
+		printk(KERN_INFO "\t * RX aggregation\n");
+}
+
 static int check_esp_version(struct fw_version *ver)
 {
 	printk(KERN_INFO "esp32: ESP Firmware version: %u.%u.%u\n",
@@ -277,24 +418,81 @@ int process_fw_data(struct fw_data *fw_p)
 
 static int esp_open(struct net_device *ndev)
 {
+	struct esp_wifi_device *priv = netdev_priv(ndev);
+
+	napi_enable(&priv->napi);
 /*	netif_start_queue(ndev);*/
 	return 0;
 }
 
 static int esp_stop(struct net_device *ndev)
 {
+	struct esp_wifi_device *priv = netdev_priv(ndev);
+
 /*	netif_stop_queue(ndev);*/
+	napi_disable(&priv->napi);
+	skb_queue_purge(&priv->rx_q);
+	esp_purge_tx_batch(priv);
 	return 0;
 }
 
-static struct net_device_stats* esp_get_stats(struct net_device *ndev)
+static int esp_napi_poll(struct napi_struct *napi, int budget)
+{
+	struct esp_wifi_device *priv = container_of(napi, struct esp_wifi_device, napi);
+	struct sk_buff *skb = NULL;
+	int work_done = 0;
+
+	while (work_done < budget) {
+		skb = skb_dequeue(&priv->rx_q);
+		if (!skb)
+			break;
+
+		napi_gro_receive(napi, skb);
+		work_done++;
+	}
+
+	if (work_done < budget) {
+		napi_complete_done(napi, work_done);
+
+		/* Frames queued after last dequeue could have missed schedule */
+		if (!skb_queue_empty(&priv->rx_q))
+			napi_schedule(napi);
+	}
+
+	return work_done;
+}
+
+/* TX packets and bytes are counted per queue, as queues flush concurrently */
+NDO_GET_STATS64_PROTOTYPE()
 {
 	struct esp_wifi_device *priv = netdev_priv(ndev);
+	struct esp_tx_queue_stats *tx_stats = NULL;
+	unsigned int start;
+	u64 packets, bytes;
+	u8 ac;
 
 	if (!priv)
-		return NULL;
+		NDO_GET_STATS64_RETURN(stats);
+
+	for (ac = 0; ac < ESP_MAX_AC; ac++) {
+		tx_stats = &priv->tx_stats[ac];
+
+		do {
+			start = u64_stats_fetch_begin(&tx_stats->syncp);
+			packets = tx_stats->packets;
+			bytes = tx_stats->bytes;
+		} while (u64_stats_fetch_retry(&tx_stats->syncp, start));
 
-	return &priv->stats;
+		stats->tx_packets += packets;
+		stats->tx_bytes += bytes;
+	}
+
+	stats->tx_dropped = atomic_long_read(&priv->tx_dropped);
+	stats->rx_packets = priv->stats.rx_packets;
+	stats->rx_bytes = priv->stats.rx_bytes;
+	stats->rx_dropped = priv->stats.rx_dropped;
+
+	NDO_GET_STATS64_RETURN(stats);
 }
 
 static int esp_set_mac_address(struct net_device *ndev, void *data)
@@ -321,6 +519,14 @@ static void esp_set_rx_mode(struct net_device *ndev)
 {
 }
 
+/* One netdev TX queue per access category, picked from DSCP/skb->priority */
+NDO_SELECT_QUEUE_PROTOTYPE()
+{
+	skb->priority = ESP_CLASSIFY_8021D(skb);
+
+	return esp_8021d_to_ac[skb->priority & 7];
+}
+
 static int esp_hard_start_xmit(struct sk_buff *skb, struct net_device *ndev)
 {
 	struct esp_wifi_device *priv = NULL;
@@ -336,7 +542,7 @@ static int esp_hard_start_xmit(struct sk_buff *skb, struct net_device *ndev)
 	}
 
 	if (!priv->port_open) {
-		priv->stats.tx_dropped++;
+		esp_tx_drop(priv, ESP_TX_DROP_PORT_CLOSED);
 		/*printk(KERN_ERR "esp32: %s: port not yet open\n", __func__);*/
 		dev_kfree_skb(skb);
 		return NETDEV_TX_OK;
@@ -344,7 +550,7 @@ static int esp_hard_start_xmit(struct sk_buff *skb, struct net_device *ndev)
 
 	if (!skb->len || (skb->len > ETH_FRAME_LEN)) {
 		printk(KERN_ERR "esp32: %s: Bad len %d\n", __func__, skb->len);
-		priv->stats.tx_dropped++;
+		esp_tx_drop(priv, ESP_TX_DROP_BAD_LEN);
 		dev_kfree_skb(skb);
 		return NETDEV_TX_OK;
 	}
@@ -359,19 +565,36 @@ static const struct net_device_ops esp_netdev_ops = {
 	.ndo_open = esp_open,
 	.ndo_stop = esp_stop,
 	.ndo_start_xmit = esp_hard_start_xmit,
+	.ndo_select_queue = esp_select_queue,
 	.ndo_set_mac_address = esp_set_mac_address,
 	.ndo_validate_addr = eth_validate_addr,
 	.ndo_tx_timeout = esp_tx_timeout,
-	.ndo_get_stats = esp_get_stats,
+	.ndo_get_stats64 = esp_get_stats64,
 	.ndo_set_rx_mode = esp_set_rx_mode,
 };
 
 
 void esp_init_priv(struct net_device *ndev)
 {
+	struct esp_wifi_device *priv = netdev_priv(ndev);
+
+	u8 ac;
+
+	skb_queue_head_init(&priv->rx_q);
+	for (ac = 0; ac < ESP_MAX_AC; ac++) {
+		skb_queue_head_init(&priv->tx_batch[ac]);
+		u64_stats_init(&priv->tx_stats[ac].syncp);
+	}
+	ESP_NETIF_NAPI_ADD(ndev, &priv->napi, esp_napi_poll);
+
 	ndev->netdev_ops = &esp_netdev_ops;
+	esp_set_ethtool_ops(ndev);
 	ndev->needed_headroom = roundup(sizeof(struct esp_payload_header) +
 			INTERFACE_HEADER_PADDING, 4);
+
+	/* Transports gather frags themselves, no need to linearize */
+	ndev->hw_features |= NETIF_F_SG;
+	ndev->features |= NETIF_F_SG;
 }
 
 #if 0
@@ -422,10 +645,9 @@ void start_scan(struct esp_wifi_device *priv, char *ssid, u8 ssid_len)
 }
 #endif
 
-static int add_network_iface(void)
+static int add_network_iface(struct esp_adapter *adapter)
 {
 	int ret = 0;
-	struct esp_adapter * adapter = esp_get_adapter();
 
 	if (!adapter) {
 		printk(KERN_INFO "%s: adapter not yet init\n", __func__);
@@ -455,7 +677,7 @@ int esp_add_card(struct esp_adapter *adapter)
 		return ret;
 	}
 
-	ret = add_network_iface();
+	ret = add_network_iface(adapter);
 
 	return ret;
 }
@@ -488,6 +710,9 @@ void esp_remove_network_interfaces(struct esp_adapter *adapter)
 
 			if (ndev->reg_state == NETREG_REGISTERED) {
 				unregister_netdev(ndev);
+				netif_napi_del(&priv->napi);
+				skb_queue_purge(&priv->rx_q);
+				esp_purge_tx_batch(priv);
 				free_netdev(ndev);
 				ndev = NULL;
 			}
@@ -535,16 +760,16 @@ int esp_remove_card(struct esp_adapter *adapter)
 }
 
 struct esp_wifi_device * get_priv_from_payload_header(
-		struct esp_payload_header *header)
+		struct esp_adapter *adapter, struct esp_payload_header *header)
 {
 	struct esp_wifi_device *priv = NULL;
 	u8 i = 0;
 
-	if (!header)
+	if (!adapter || !header)
 		return NULL;
 
 	for (i = 0; i < ESP_MAX_INTERFACE; i++) {
-		priv = adapter.priv[i];
+		priv = adapter->priv[i];
 
 		if (!priv)
 			continue;
@@ -571,6 +796,10 @@ static void process_esp_bootup_event(struct esp_adapter *adapter,
 	}
 
 	printk (KERN_INFO "\nReceived ESP bootup event\n");
+
+	/* Firmware without ext capability tag expects checksum */
+	adapter->ext_capabilities = 0;
+
 	process_event_esp_bootup(adapter, evt->data, evt->len);
 }
 
@@ -631,7 +860,7 @@ static void process_rx_packet(struct esp_adapter *adapter, struct sk_buff *skb)
 	if (payload_header->if_type == ESP_STA_IF || payload_header->if_type == ESP_AP_IF) {
 
 		/* retrieve priv based on payload header contents */
-		priv = get_priv_from_payload_header(payload_header);
+		priv = get_priv_from_payload_header(adapter, payload_header);
 
 		if (!priv) {
 			printk(KERN_ERR "%s: empty priv\n", __func__);
@@ -655,7 +884,7 @@ static void process_rx_packet(struct esp_adapter *adapter, struct sk_buff *skb)
 
 			eth = skb_put(eap_skb, ETH_HLEN);
 			ether_addr_copy(eth->h_dest, /*skb->data*/priv->ndev->dev_addr);
-			ether_addr_copy(eth->h_source, /*skb->data+6*/ ap_bssid);
+			ether_addr_copy(eth->h_source, /*skb->data+6*/ priv->ap_bssid);
 			eth->h_proto = cpu_to_be16(ETH_P_PAE);
 
 			skb_put_data(eap_skb, skb->data, skb->len);
@@ -665,13 +894,20 @@ static void process_rx_packet(struct esp_adapter *adapter, struct sk_buff *skb)
 
 		} else if (payload_header->packet_type == PACKET_TYPE_DATA) {
 
+			if (!netif_running(priv->ndev) ||
+			    skb_queue_len(&priv->rx_q) >= ESP_RX_Q_MAX_LEN) {
+				priv->stats.rx_dropped++;
+				dev_kfree_skb_any(skb);
+				return;
+			}
+
 			skb->dev = priv->ndev;
 			skb->protocol = eth_type_trans(skb, priv->ndev);
 			skb->ip_summed = CHECKSUM_NONE;
 
 			priv->stats.rx_bytes += skb->len;
-			/* Forward skb to kernel */
-			netif_rx_ni(skb);
+			/* Queue skb for NAPI poll, scheduled once transport is drained */
+			skb_queue_tail(&priv->rx_q, skb);
 
 			priv->stats.rx_packets++;
 		} else if (payload_header->packet_type == PACKET_TYPE_COMMAND_RESPONSE) {
@@ -713,26 +949,54 @@ static void process_rx_packet(struct esp_adapter *adapter, struct sk_buff *skb)
 	}
 }
 
-void esp_tx_pause(struct esp_wifi_device *priv)
+void esp_tx_pause(struct esp_wifi_device *priv, u8 ac)
 {
-	if (!priv || !priv->ndev)
+	if (!priv || !priv->ndev || ac >= ESP_MAX_AC)
 		return;
 
-	if (!netif_queue_stopped((const struct net_device *)priv->ndev)) {
-		netif_stop_queue(priv->ndev);
+	if (!__netif_subqueue_stopped(priv->ndev, ac)) {
+		netif_stop_subqueue(priv->ndev, ac);
 	}
 }
 
-void esp_tx_resume(struct esp_wifi_device *priv)
+void esp_tx_resume(struct esp_wifi_device *priv, u8 ac)
 {
-	if (!priv || !priv->ndev)
+	if (!priv || !priv->ndev || ac >= ESP_MAX_AC)
 		return;
 
-	if (netif_queue_stopped((const struct net_device *)priv->ndev)) {
-		netif_wake_queue(priv->ndev);
+	if (__netif_subqueue_stopped(priv->ndev, ac)) {
+		netif_wake_subqueue(priv->ndev, ac);
 	}
 }
 
+/* Byte queue limits on data frames held in transport queues. Sent side
+ * runs under lock of netdev TX queue and must precede frame being visible
+ * to transport TX context, which reports completion */
+void esp_tx_sent(struct esp_wifi_device *priv, u8 ac, u32 bytes)
+{
+	if (!priv || !priv->ndev || ac >= ESP_MAX_AC)
+		return;
+
+	netdev_tx_sent_queue(netdev_get_tx_queue(priv->ndev, ac), bytes);
+}
+
+void esp_tx_completed(struct esp_wifi_device *priv, u8 ac, u32 packets, u32 bytes)
+{
+	if (!priv || !priv->ndev || ac >= ESP_MAX_AC)
+		return;
+
+	netdev_tx_completed_queue(netdev_get_tx_queue(priv->ndev, ac), packets, bytes);
+}
+
+void esp_tx_drop(struct esp_wifi_device *priv, u8 reason)
+{
+	if (!priv || reason >= ESP_TX_DROP_MAX)
+		return;
+
+	atomic_long_inc(&priv->tx_drops[reason]);
+	atomic_long_inc(&priv->tx_dropped);
+}
+
 struct sk_buff * esp_alloc_skb(u32 len)
 {
 	struct sk_buff *skb = NULL;
@@ -753,21 +1017,65 @@ struct sk_buff * esp_alloc_skb(u32 len)
 }
 
 
-static int esp_get_packets(struct esp_adapter *adapter)
+static void esp_schedule_napi(struct esp_adapter *adapter)
+{
+	struct esp_wifi_device *priv = NULL;
+	uint8_t iface_idx = 0;
+
+	/* Softirq raised by napi_schedule runs on local_bh_enable */
+	local_bh_disable();
+
+	for (iface_idx = 0; iface_idx < ESP_MAX_INTERFACE; iface_idx++) {
+		priv = adapter->priv[iface_idx];
+
+		if (priv && !skb_queue_empty(&priv->rx_q))
+			napi_schedule(&priv->napi);
+	}
+
+	local_bh_enable();
+}
+
+/* Drain inbound packets from transport, up to budget packets.
+ * Returns number of packets processed */
+static int esp_get_packets(struct esp_adapter *adapter, int budget)
 {
 	struct sk_buff *skb = NULL;
+	struct sk_buff_head rx_list;
+	int count = 0;
 
 	if (!adapter || !adapter->if_ops || !adapter->if_ops->read)
 		return -EINVAL;
 
-	skb = adapter->if_ops->read(adapter);
+	if (adapter->if_ops->read_batch) {
+		__skb_queue_head_init(&rx_list);
 
-	if (!skb)
-		return -EFAULT;
+		/* Each batch is read with single bus lock acquisition */
+		while (count < budget) {
+			if (adapter->if_ops->read_batch(adapter, &rx_list) <= 0)
+				break;
 
-	process_rx_packet(adapter, skb);
+			while ((skb = __skb_dequeue(&rx_list))) {
+				process_rx_packet(adapter, skb);
+				count++;
+			}
+		}
+	} else {
+		while (count < budget) {
+			skb = adapter->if_ops->read(adapter);
 
-	return 0;
+			if (!skb)
+				break;
+
+			process_rx_packet(adapter, skb);
+			count++;
+		}
+	}
+
+	/* Data frames are handed to stack from NAPI poll, as one batch */
+	if (count)
+		esp_schedule_napi(adapter);
+
+	return count;
 }
 
 int esp_send_packet(struct esp_adapter *adapter, struct sk_buff *skb)
@@ -780,59 +1088,117 @@ int esp_send_packet(struct esp_adapter *adapter, struct sk_buff *skb)
 
 static void esp_if_rx_work(struct work_struct *work)
 {
-	/* read inbound packet and forward it to network/serial interface */
-	esp_get_packets(&adapter);
+	struct esp_adapter *adapter = container_of(work, struct esp_adapter, if_rx_work);
+	/* rx_budget is writable at runtime, same value bounds the loop and
+	 * decides on requeue */
+	int budget = READ_ONCE(rx_budget);
+
+	if (budget <= 0)
+		budget = 1;
+
+	/* read inbound packets and forward them to network/serial interface */
+	if (esp_get_packets(adapter, budget) >= budget) {
+		/* Budget exhausted, yield and continue in next invocation */
+		queue_work(adapter->if_rx_workqueue, &adapter->if_rx_work);
+	}
 }
 
 static void esp_events_work(struct work_struct *work)
 {
+	struct esp_adapter *adapter = container_of(work, struct esp_adapter, events_work);
 	struct sk_buff *skb = NULL;
 
-	skb = skb_dequeue(&adapter.events_skb_q);
+	skb = skb_dequeue(&adapter->events_skb_q);
 	if (!skb)
 		return;
 
-	process_internal_event(&adapter, skb);
+	process_internal_event(adapter, skb);
 	dev_kfree_skb_any(skb);
 }
 
-static struct esp_adapter * init_adapter(void)
+/* Lowest index not used by any probed adapter. Caller holds adapter_list_lock */
+static int get_free_adapter_idx(void)
 {
-	memset(&adapter, 0, sizeof(adapter));
+	struct esp_adapter *entry = NULL;
+	int idx = 0;
+
+restart:
+	list_for_each_entry(entry, &adapter_list, list) {
+		if (entry->idx == idx) {
+			idx++;
+			goto restart;
+		}
+	}
+
+	return idx;
+}
+
+static void deinit_adapter(struct esp_adapter *adapter)
+{
+	skb_queue_purge(&adapter->events_skb_q);
+
+	if (adapter->events_wq)
+		destroy_workqueue(adapter->events_wq);
+
+	if (adapter->if_rx_workqueue)
+		destroy_workqueue(adapter->if_rx_workqueue);
+}
+
+/* Called by transport layer for each detected ESP device */
+struct esp_adapter * esp_alloc_adapter(void)
+{
+	struct esp_adapter *adapter = NULL;
+
+	adapter = kzalloc(sizeof(struct esp_adapter), GFP_KERNEL);
+
+	if (!adapter)
+		return NULL;
+
+	mutex_lock(&adapter_list_lock);
+	adapter->idx = get_free_adapter_idx();
+	list_add_tail(&adapter->list, &adapter_list);
+	mutex_unlock(&adapter_list_lock);
 
 	/* Prepare interface RX work */
-	adapter.if_rx_workqueue = alloc_workqueue("ESP_IF_RX_WORK_QUEUE", 0, 0);
+	adapter->if_rx_workqueue = alloc_workqueue("ESP_IF_RX_WORK_QUEUE/%d",
+			0, 0, adapter->idx);
 
-	if (!adapter.if_rx_workqueue) {
-		deinit_adapter();
+	if (!adapter->if_rx_workqueue) {
+		esp_free_adapter(adapter);
 		return NULL;
 	}
 
-	INIT_WORK(&adapter.if_rx_work, esp_if_rx_work);
+	INIT_WORK(&adapter->if_rx_work, esp_if_rx_work);
 
-	skb_queue_head_init(&adapter.events_skb_q);
+	skb_queue_head_init(&adapter->events_skb_q);
 
-	adapter.events_wq = alloc_workqueue("ESP_EVENTS_WORKQUEUE", WQ_HIGHPRI, 0);
+	adapter->events_wq = alloc_workqueue("ESP_EVENTS_WORKQUEUE/%d",
+			WQ_HIGHPRI, 0, adapter->idx);
 
-	if (!adapter.events_wq) {
-		deinit_adapter();
+	if (!adapter->events_wq) {
+		esp_free_adapter(adapter);
 		return NULL;
 	}
 
-	INIT_WORK(&adapter.events_work, esp_events_work);
+	INIT_WORK(&adapter->events_work, esp_events_work);
 
-	return &adapter;
+	esp_tx_sched_init(&adapter->tx_sched);
+
+	return adapter;
 }
 
-static void deinit_adapter(void)
+void esp_free_adapter(struct esp_adapter *adapter)
 {
-	skb_queue_purge(&adapter.events_skb_q);
+	if (!adapter)
+		return;
 
-	if (adapter.events_wq)
-		destroy_workqueue(adapter.events_wq);
+	deinit_adapter(adapter);
 
-	if (adapter.if_rx_workqueue)
-		destroy_workqueue(adapter.if_rx_workqueue);
+	mutex_lock(&adapter_list_lock);
+	list_del(&adapter->list);
+	mutex_unlock(&adapter_list_lock);
+
+	kfree(adapter);
 }
 
 static void esp_reset(void)
@@ -863,38 +1229,33 @@ static void esp_reset(void)
 
 static int __init esp_init(void)
 {
-	int ret = 0;
-	struct esp_adapter *adapter = NULL;
-
 	/* Reset ESP, Clean start ESP */
 	esp_reset();
 	msleep(200);
 
-	adapter = init_adapter();
-
-	if (!adapter)
-		return -EFAULT;
-
-	/* Init transport layer */
-	ret = esp_init_interface_layer(adapter);
-
-	if (ret != 0) {
-		deinit_adapter();
-	}
+#ifdef CONFIG_ENABLE_CHECKSUM_BENCHMARK
+	esp_checksum_benchmark();
+#endif
 
-	return ret;
+	/* Init transport layer, adapters are allocated as devices get probed */
+	return esp_init_interface_layer();
 }
 
 static void __exit esp_exit(void)
 {
+	struct esp_adapter *adapter = NULL;
 	uint8_t iface_idx = 0;
 
-	for (iface_idx=0; iface_idx<ESP_MAX_INTERFACE; iface_idx++) {
-		cmd_deinit_interface(adapter.priv[iface_idx]);
+	mutex_lock(&adapter_list_lock);
+	list_for_each_entry(adapter, &adapter_list, list) {
+		for (iface_idx=0; iface_idx<ESP_MAX_INTERFACE; iface_idx++) {
+			cmd_deinit_interface(adapter->priv[iface_idx]);
+		}
 	}
+	mutex_unlock(&adapter_list_lock);
 
+	/* Transport layer frees each adapter on device removal */
 	esp_deinit_interface_layer();
-	deinit_adapter();
 
 	if (resetpin != HOST_GPIO_PIN_INVALID) {
 		gpio_free(resetpin);
@@ -27,30 +27,61 @@
 #include "esp_sdio_api.h"
 #include "esp_api.h"
 #include "esp_bt_api.h"
+#include "esp_tx_sched.h"
 #include <linux/kthread.h>
 #include <linux/printk.h>
 
-#define MAX_WRITE_RETRIES       2
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0))
+#define reinit_completion(x)    INIT_COMPLETION(*(x))
+#endif
+
+/* Short sleeps on exhausted TX credits before waiting for slave */
+#define TX_CREDIT_SPINS         2
+#define TX_CREDIT_WAIT_MS       1
+/* Per AC data queue. Netdev queue is stopped at TX_STOP_THRESHOLD, which
+ * leaves room for a TX batch already taken from stack */
 #define TX_MAX_PENDING_COUNT    200
+#define TX_STOP_THRESHOLD       (TX_MAX_PENDING_COUNT - ESP_TX_BATCH_MAX)
 #define TX_RESUME_THRESHOLD     (TX_MAX_PENDING_COUNT/5)
+#define SDIO_RX_BATCH_MAX       16
+
+/* Adaptive RX defaults, changed through ethtool -C */
+#define RX_POLL_USECS_DEFAULT   200
+#define RX_POLL_USECS_MIN       20
+#define RX_POLL_FRAMES_DEFAULT  8
+#define RX_IDLE_USECS_DEFAULT   2000
+/* Slave RX buffers filled by one aggregated CMD53 */
+#define ESP_TX_AGGR_MAX_BUFS    4
+#define ESP_TX_AGGR_ALIGN       4
+/* Start of frames after first in one read, see ESP_RX_AGGREGATION */
+#define ESP_RX_AGGR_ALIGN       4
+/* Largest aggregate plus block padding added by tx_process */
+#define SDIO_TX_BUF_SIZE        (ESP_TX_AGGR_MAX_BUFS * ESP_RX_BUFFER_SIZE + ESP_BLOCK_SIZE)
 
 #define CHECK_SDIO_RW_ERROR(ret) do {			\
 	if (ret)						\
 	printk(KERN_ERR "%s: CMD53 read/write error at %d\n", __func__, __LINE__);	\
 } while (0);
 
-struct esp_sdio_context sdio_context;
-static atomic_t tx_pending;
-static atomic_t queue_items[MAX_PRIORITY_QUEUES];
-
-#ifdef CONFIG_ENABLE_MONITOR_PROCESS
-struct task_struct *monitor_thread;
-#endif
-struct task_struct *tx_thread;
-
 static int init_context(struct esp_sdio_context *context);
+static void tx_slot_work(struct work_struct *work);
+
+static bool reg_snapshot;
+module_param(reg_snapshot, bool, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(reg_snapshot, "Read SDIO token, interrupt status and packet length registers in one CMD53");
+static bool tx_sg;
+module_param(tx_sg, bool, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(tx_sg, "Send TX frames by scatter-gather CMD53, without copy to bounce buffer");
+static bool tx_pipeline;
+module_param(tx_pipeline, bool, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(tx_pipeline, "Prepare next TX transfer while current one is on the bus");
+static bool rx_adaptive;
+module_param(rx_adaptive, bool, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(rx_adaptive, "Poll slave for RX instead of waiting for interrupt while downlink is busy, tuned by ethtool -C");
 static struct sk_buff * read_packet(struct esp_adapter *adapter);
 static int write_packet(struct esp_adapter *adapter, struct sk_buff *skb);
+static int read_packet_batch(struct esp_adapter *adapter, struct sk_buff_head *list);
+static int write_packet_batch(struct esp_adapter *adapter, struct sk_buff_head *list);
 /*int deinit_context(struct esp_adapter *adapter);*/
 
 static const struct sdio_device_id esp_devices[] = {
@@ -59,6 +90,64 @@ static const struct sdio_device_id esp_devices[] = {
 	{}
 };
 
+/* Reads 32 bit register through reg_buf */
+static int esp_read_reg32(struct esp_sdio_context *context, u32 reg, u32 *val,
+		u8 is_lock_needed)
+{
+	int ret = 0;
+
+	if (is_lock_needed)
+		sdio_claim_host(context->func);
+
+	ret = esp_read_reg(context, reg, context->reg_buf, sizeof(*val),
+			LOCK_ALREADY_ACQUIRED);
+
+	if (!ret)
+		*val = *(u32 *) context->reg_buf;
+
+	if (is_lock_needed)
+		sdio_release_host(context->func);
+
+	return ret;
+}
+
+/* Reads token, interrupt status and packet length in one CMD53.
+ * Caller must hold the host */
+static int esp_read_reg_snapshot(struct esp_sdio_context *context, u32 *int_status)
+{
+	u8 *buf = context->reg_buf;
+	int ret = 0;
+
+	ret = esp_read_reg(context, ESP_SLAVE_SNAPSHOT_START, buf,
+			ESP_SLAVE_SNAPSHOT_LEN, LOCK_ALREADY_ACQUIRED);
+
+	if (ret)
+		return ret;
+
+	context->snap_val[ESP_SNAP_TOKEN] =
+		*(u32 *) (buf + ESP_SNAPSHOT_OFFSET(ESP_SLAVE_TOKEN_RDATA));
+	context->snap_val[ESP_SNAP_PACKET_LEN] =
+		*(u32 *) (buf + ESP_SNAPSHOT_OFFSET(ESP_SLAVE_PACKET_LEN_REG));
+	context->snap_valid = BIT(ESP_SNAP_TOKEN) | BIT(ESP_SNAP_PACKET_LEN);
+
+	if (int_status)
+		*int_status = *(u32 *) (buf + ESP_SNAPSHOT_OFFSET(ESP_SLAVE_INT_ST_REG));
+
+	return 0;
+}
+
+/* Consumes value of last snapshot, caller must hold the host */
+static bool esp_take_snapshot_val(struct esp_sdio_context *context, u8 idx, u32 *val)
+{
+	if (!(context->snap_valid & BIT(idx)))
+		return false;
+
+	context->snap_valid &= ~BIT(idx);
+	*val = context->snap_val[idx];
+
+	return true;
+}
+
 static void esp_process_interrupt(struct esp_sdio_context *context, u32 int_status)
 {
 	if (!context) {
@@ -70,10 +159,11 @@ static void esp_process_interrupt(struct esp_sdio_context *context, u32 int_stat
 	}
 }
 
+/* Called by SDIO core with host claimed */
 static void esp_handle_isr(struct sdio_func *func)
 {
 	struct esp_sdio_context *context = NULL;
-	u32 *int_status;
+	u32 int_status = 0;
 	int ret;
 
 	if (!func) {
@@ -82,53 +172,135 @@ static void esp_handle_isr(struct sdio_func *func)
 
 	context = sdio_get_drvdata(func);
 
-	if (!context) {
+	if (!context || !context->reg_buf) {
 		return;
 	}
 
-	int_status = kmalloc(sizeof(u32), GFP_ATOMIC);
-
-	if (!int_status) {
-		return;
-	}
+	atomic64_inc(&context->adapter->rx_poll_stats.interrupts);
 
-	/* Read interrupt status register */
-	ret = esp_read_reg(context, ESP_SLAVE_INT_ST_REG,
-			(u8 *) int_status, sizeof(* int_status), ACQUIRE_LOCK);
+	/* Read interrupt status register, along with packet length and
+	 * token for the RX and TX passes that follow, in snapshot mode */
+	if (reg_snapshot)
+		ret = esp_read_reg_snapshot(context, &int_status);
+	else
+		ret = esp_read_reg32(context, ESP_SLAVE_INT_ST_REG, &int_status, ACQUIRE_LOCK);
 	CHECK_SDIO_RW_ERROR(ret);
 
-	esp_process_interrupt(context, *int_status);
+	esp_process_interrupt(context, int_status);
+
+	/* Slave may have freed buffers, let TX thread waiting for them retry */
+	atomic_set(&context->tx_credit_kick, 1);
+	wake_up_interruptible(&context->tx_wait);
 
 	/* Clear interrupt status */
+	*(u32 *) context->reg_buf = int_status;
 	ret = esp_write_reg(context, ESP_SLAVE_INT_CLR_REG,
-			(u8 *) int_status, sizeof(* int_status), ACQUIRE_LOCK);
+			context->reg_buf, sizeof(int_status), ACQUIRE_LOCK);
 	CHECK_SDIO_RW_ERROR(ret);
-
-	kfree(int_status);
 }
 
-int generate_slave_intr(struct esp_sdio_context *context, u8 data)
+/* Masks or unmasks RX_NEW_PACKET at slave, caller must hold the host */
+static int esp_set_rx_intr(struct esp_sdio_context *context, bool enable)
 {
-	u8 *val;
+	u32 ena = 0;
 	int ret = 0;
 
-	if (!context)
-		return -EINVAL;
+	ret = esp_read_reg32(context, ESP_SLAVE_INT_ENA_REG, &ena, LOCK_ALREADY_ACQUIRED);
+	if (ret)
+		return ret;
 
-	val = kmalloc(sizeof(u8), GFP_KERNEL);
+	if (enable)
+		ena |= ESP_SLAVE_RX_NEW_PACKET_INT;
+	else
+		ena &= ~ESP_SLAVE_RX_NEW_PACKET_INT;
 
-	if (!val) {
-		return -ENOMEM;
-	}
+	*(u32 *) context->reg_buf = ena;
 
-	*val = data;
+	return esp_write_reg(context, ESP_SLAVE_INT_ENA_REG, context->reg_buf,
+			sizeof(ena), LOCK_ALREADY_ACQUIRED);
+}
 
-	ret = esp_write_reg(context, ESP_SLAVE_SCRATCH_REG_7, val,
-			sizeof(*val), ACQUIRE_LOCK);
+/* Stands in for RX interrupt in poll mode. Runs in hard IRQ context, so
+ * only queues RX work, which reads PACKET_LEN_REG */
+static enum hrtimer_restart rx_poll_timer_cb(struct hrtimer *timer)
+{
+	struct esp_sdio_context *context = container_of(timer,
+			struct esp_sdio_context, rx_poll_timer);
 
-	kfree(val);
+	if (!context->rx_poll)
+		return HRTIMER_NORESTART;
 
-	return ret;
+	atomic64_inc(&context->adapter->rx_poll_stats.polls);
+	esp_process_new_packet_intr(context->adapter);
+
+	/* No interrupt tells about freed slave buffers either */
+	atomic_set(&context->tx_credit_kick, 1);
+	wake_up_interruptible(&context->tx_wait);
+
+	hrtimer_forward_now(timer, ns_to_ktime(context->rx_poll_usecs * NSEC_PER_USEC));
+
+	return HRTIMER_RESTART;
+}
+
+/* Caller must hold the host */
+static void rx_poll_enter(struct esp_sdio_context *context)
+{
+	if (esp_set_rx_intr(context, false))
+		return;
+
+	context->rx_poll = 1;
+	atomic64_inc(&context->adapter->rx_poll_stats.poll_enter);
+
+	hrtimer_start(&context->rx_poll_timer,
+			ns_to_ktime(context->rx_poll_usecs * NSEC_PER_USEC),
+			HRTIMER_MODE_REL);
+}
+
+/* Caller must hold the host. Stays in poll mode if interrupt could not be
+ * unmasked, so that RX is not left without both */
+static void rx_poll_exit(struct esp_sdio_context *context)
+{
+	if (esp_set_rx_intr(context, true))
+		return;
+
+	context->rx_poll = 0;
+	atomic64_inc(&context->adapter->rx_poll_stats.poll_exit);
+
+	/* Callback never takes the host, no deadlock here */
+	hrtimer_cancel(&context->rx_poll_timer);
+}
+
+/* Switches between interrupt and poll mode after RX batch of count frames.
+ * Caller must hold the host */
+static void rx_adapt(struct esp_sdio_context *context, int count)
+{
+	ktime_t now;
+
+	if (context->state != ESP_CONTEXT_READY)
+		return;
+
+	now = ktime_get();
+
+	if (count > 0)
+		context->rx_last_data = now;
+
+	if (!context->rx_poll) {
+		if (context->rx_adaptive && count >= context->rx_poll_frames)
+			rx_poll_enter(context);
+	} else if (!count && ktime_us_delta(now, context->rx_last_data) >
+			context->rx_idle_usecs) {
+		rx_poll_exit(context);
+	}
+}
+
+int generate_slave_intr(struct esp_sdio_context *context, u8 data)
+{
+	if (!context)
+		return -EINVAL;
+
+	/* Single byte goes by value through CMD52, no buffer needed */
+	return esp_write_reg(context, ESP_SLAVE_SCRATCH_REG_7, &data,
+			sizeof(data), ACQUIRE_LOCK);
 }
 
 static void deinit_sdio_func(struct sdio_func *func)
@@ -142,70 +314,108 @@ static void deinit_sdio_func(struct sdio_func *func)
 	sdio_set_drvdata(func, NULL);
 }
 
+static u32 get_tx_buffer_num(struct esp_sdio_context *context, u32 token)
+{
+	token = (token >> 16) & ESP_TX_BUFFER_MASK;
+
+	return (token + ESP_TX_BUFFER_MAX - context->tx_buffer_count) % ESP_TX_BUFFER_MAX;
+}
+
 static int esp_slave_get_tx_buffer_num(struct esp_sdio_context *context, u32 *tx_num, u8 is_lock_needed)
 {
-	u32 *len = NULL;
+	u32 token = 0;
 	int ret = 0;
 
-	len = kmalloc(sizeof(u32), GFP_KERNEL);
+	if (!reg_snapshot) {
+		ret = esp_read_reg32(context, ESP_SLAVE_TOKEN_RDATA, &token, is_lock_needed);
 
-	if (!len) {
-		return -ENOMEM;
+		if (ret) {
+			return ret;
+		}
+
+		*tx_num = get_tx_buffer_num(context, token);
+		return 0;
 	}
 
-	ret = esp_read_reg(context, ESP_SLAVE_TOKEN_RDATA, (u8*) len, sizeof(*len), is_lock_needed);
+	if (is_lock_needed)
+		sdio_claim_host(context->func);
 
-	if (ret) {
-		kfree(len);
-		return ret;
+	/* Snapshot may predate slots now in flight, in pipeline mode too.
+	 * It still can not overstate free buffers: token only grows, every
+	 * buffer taken was granted by this or an older token read, and
+	 * caller takes off buffers of slots in flight. Read afresh when it
+	 * shows no buffer */
+	if (!esp_take_snapshot_val(context, ESP_SNAP_TOKEN, &token) ||
+	    !get_tx_buffer_num(context, token)) {
+		ret = esp_read_reg_snapshot(context, NULL);
+
+		if (!ret)
+			esp_take_snapshot_val(context, ESP_SNAP_TOKEN, &token);
 	}
 
-	*len = (*len >> 16) & ESP_TX_BUFFER_MASK;
-	*len = (*len + ESP_TX_BUFFER_MAX - context->tx_buffer_count) % ESP_TX_BUFFER_MAX;
+	if (!ret)
+		*tx_num = get_tx_buffer_num(context, token);
 
-	*tx_num = *len;
+	if (is_lock_needed)
+		sdio_release_host(context->func);
 
-	kfree(len);
 	return ret;
 }
 
-static int esp_get_len_from_slave(struct esp_sdio_context *context, u32 *rx_size, u8 is_lock_needed)
+static int esp_read_packet_len_reg(struct esp_sdio_context *context, u32 *len, u8 is_lock_needed)
 {
-	u32 *len;
-	u32 temp;
 	int ret = 0;
 
-	len = kmalloc(sizeof(u32), GFP_KERNEL);
+	if (!reg_snapshot)
+		return esp_read_reg32(context, ESP_SLAVE_PACKET_LEN_REG, len, is_lock_needed);
 
-	if (!len) {
-		return -ENOMEM;
+	if (is_lock_needed)
+		sdio_claim_host(context->func);
+
+	/* Nothing was read since snapshot, so its length can only fall
+	 * short. Read afresh when it shows nothing new */
+	if (!esp_take_snapshot_val(context, ESP_SNAP_PACKET_LEN, len) ||
+	    (*len & ESP_SLAVE_LEN_MASK) == context->rx_byte_count) {
+		ret = esp_read_reg_snapshot(context, NULL);
+
+		if (!ret)
+			esp_take_snapshot_val(context, ESP_SNAP_PACKET_LEN, len);
 	}
 
-	ret = esp_read_reg(context, ESP_SLAVE_PACKET_LEN_REG,
-			(u8 *) len, sizeof(*len), is_lock_needed);
+	if (is_lock_needed)
+		sdio_release_host(context->func);
+
+	return ret;
+}
+
+static int esp_get_len_from_slave(struct esp_sdio_context *context, u32 *rx_size, u8 is_lock_needed)
+{
+	u32 len = 0;
+	u32 temp;
+	int ret = 0;
+
+	ret = esp_read_packet_len_reg(context, &len, is_lock_needed);
 
 	if (ret) {
-		kfree (len);
 		return ret;
 	}
 
-	*len &= ESP_SLAVE_LEN_MASK;
+	len &= ESP_SLAVE_LEN_MASK;
 
-	if (*len >= context->rx_byte_count)
-		*len = (*len + ESP_RX_BYTE_MAX - context->rx_byte_count) % ESP_RX_BYTE_MAX;
+	if (len >= context->rx_byte_count)
+		len = (len + ESP_RX_BYTE_MAX - context->rx_byte_count) % ESP_RX_BYTE_MAX;
 	else {
 		/* Handle a case of roll over */
 		temp = ESP_RX_BYTE_MAX - context->rx_byte_count;
-		*len = temp + *len;
+		len = temp + len;
 
-		if (*len > ESP_RX_BUFFER_SIZE) {
+		if (len > ESP_RX_BUFFER_SIZE) {
 			printk(KERN_INFO "%s: Len from slave[%d] exceeds max [%d]\n",
-					__func__, *len, ESP_RX_BUFFER_SIZE);
+					__func__, len, ESP_RX_BUFFER_SIZE);
 		}
 	}
-	*rx_size = *len;
+	*rx_size = len;
 
-	kfree (len);
 	return 0;
 }
 
@@ -239,126 +449,197 @@ static void esp_remove(struct sdio_func *func)
 	uint8_t prio_q_idx = 0;
 	context = sdio_get_drvdata(func);
 
+	if (!context)
+		return;
+
 #ifdef CONFIG_ENABLE_MONITOR_PROCESS
-	if (monitor_thread)
-		kthread_stop(monitor_thread);
+	if (context->monitor_thread)
+		kthread_stop(context->monitor_thread);
 #endif
-	if (context) {
-		context->state = ESP_CONTEXT_INIT;
-		for (prio_q_idx=0; prio_q_idx<MAX_PRIORITY_QUEUES; prio_q_idx++)
-			skb_queue_purge(&(sdio_context.tx_q[prio_q_idx]));
-	}
+	context->state = ESP_CONTEXT_INIT;
+
+	/* No new polls, RX interrupt is of no use anymore either */
+	sdio_claim_host(context->func);
+	context->rx_poll = 0;
+	sdio_release_host(context->func);
+	hrtimer_cancel(&context->rx_poll_timer);
 
-	if (tx_thread)
-		kthread_stop(tx_thread);
+	for (prio_q_idx=0; prio_q_idx<MAX_PRIORITY_QUEUES; prio_q_idx++)
+		skb_queue_purge(&(context->tx_q[prio_q_idx]));
 
-	if (context) {
-		generate_slave_intr(context, BIT(ESP_CLOSE_DATA_PATH));
-		msleep(100);
+	if (context->tx_thread)
+		kthread_stop(context->tx_thread);
 
-		context->state = ESP_CONTEXT_DISABLED;
+	/* TX thread has reaped all slots on its way out */
+	if (context->tx_wq)
+		destroy_workqueue(context->tx_wq);
 
-		if (context->adapter) {
-			esp_remove_card(context->adapter);
+	generate_slave_intr(context, BIT(ESP_CLOSE_DATA_PATH));
+	msleep(100);
 
-			if (context->adapter->hcidev) {
-				esp_deinit_bt(context->adapter);
-			}
-		}
+	context->state = ESP_CONTEXT_DISABLED;
 
+	if (context->adapter) {
+		esp_remove_card(context->adapter);
 
-		if (context->func) {
-			deinit_sdio_func(context->func);
-			context->func = NULL;
+		if (context->adapter->hcidev) {
+			esp_deinit_bt(context->adapter);
 		}
-		memset(context, 0, sizeof(struct esp_sdio_context));
 	}
+
+
+	if (context->func) {
+		deinit_sdio_func(context->func);
+		context->func = NULL;
+	}
+
+	/* Waits for pending RX and event works of this device */
+	esp_free_adapter(context->adapter);
+	kfree(context->tx_buf);
+	kfree(context->reg_buf);
+	kfree(context);
+}
+
+/* Adaptive RX as ethtool coalesce settings:
+ *   adaptive-rx  - rx_adaptive, switch to polling under load
+ *   rx-usecs     - poll interval
+ *   rx-frames    - frames in one RX batch that switch to polling
+ *   rx-usecs-low - idle time that switches back to interrupt */
+static int esp_get_coalesce(struct esp_adapter *adapter, struct ethtool_coalesce *ec)
+{
+	struct esp_sdio_context *context = adapter->if_context;
+
+	if (!context)
+		return -ENODEV;
+
+	ec->use_adaptive_rx_coalesce = context->rx_adaptive;
+	ec->rx_coalesce_usecs = context->rx_poll_usecs;
+	ec->rx_max_coalesced_frames = context->rx_poll_frames;
+	ec->rx_coalesce_usecs_low = context->rx_idle_usecs;
+
+	return 0;
+}
+
+static int esp_set_coalesce(struct esp_adapter *adapter, struct ethtool_coalesce *ec)
+{
+	struct esp_sdio_context *context = adapter->if_context;
+
+	if (!context || !context->func)
+		return -ENODEV;
+
+	if (ec->rx_coalesce_usecs < RX_POLL_USECS_MIN ||
+	    !ec->rx_max_coalesced_frames ||
+	    ec->rx_coalesce_usecs_low < ec->rx_coalesce_usecs)
+		return -EINVAL;
+
+	sdio_claim_host(context->func);
+
+	context->rx_poll_usecs = ec->rx_coalesce_usecs;
+	context->rx_poll_frames = ec->rx_max_coalesced_frames;
+	context->rx_idle_usecs = ec->rx_coalesce_usecs_low;
+	context->rx_adaptive = ec->use_adaptive_rx_coalesce ? 1 : 0;
+
+	if (!context->rx_adaptive && context->rx_poll)
+		rx_poll_exit(context);
+
+	sdio_release_host(context->func);
+
+	return 0;
 }
 
 static struct esp_if_ops if_ops = {
 	.read		= read_packet,
 	.write		= write_packet,
+	.read_batch	= read_packet_batch,
+	.write_batch	= write_packet_batch,
+	.get_coalesce	= esp_get_coalesce,
+	.set_coalesce	= esp_set_coalesce,
 };
 
 static int init_context(struct esp_sdio_context *context)
 {
+	struct esp_tx_slot *slot = NULL;
 	int ret = 0;
-	u32 *val;
+	u32 val = 0;
 	uint8_t prio_q_idx = 0;
+	u8 i;
 
 	if (!context) {
 		return -EINVAL;
 	}
 
-	val = kmalloc(sizeof(u32), GFP_KERNEL);
-
-	if (!val) {
-		return -ENOMEM;
-	}
-
 	/* Initialize rx_byte_count */
-	ret = esp_read_reg(context, ESP_SLAVE_PACKET_LEN_REG,
-			(u8 *) val, sizeof(* val), ACQUIRE_LOCK);
+	ret = esp_read_reg32(context, ESP_SLAVE_PACKET_LEN_REG, &val, ACQUIRE_LOCK);
 	if (ret) {
-		kfree(val);
 		return ret;
 	}
 
-	context->rx_byte_count = *val & ESP_SLAVE_LEN_MASK;
+	context->rx_byte_count = val & ESP_SLAVE_LEN_MASK;
 
 	/* Initialize tx_buffer_count */
-	ret = esp_read_reg(context, ESP_SLAVE_TOKEN_RDATA, (u8 *) val,
-			sizeof(* val), ACQUIRE_LOCK);
+	ret = esp_read_reg32(context, ESP_SLAVE_TOKEN_RDATA, &val, ACQUIRE_LOCK);
 
 	if (ret) {
-		kfree(val);
 		return ret;
 	}
 
-	*val = ((*val >> 16) & ESP_TX_BUFFER_MASK);
+	val = ((val >> 16) & ESP_TX_BUFFER_MASK);
 
-	if (*val >= ESP_MAX_BUF_CNT)
-		context->tx_buffer_count = (*val) - ESP_MAX_BUF_CNT;
+	if (val >= ESP_MAX_BUF_CNT)
+		context->tx_buffer_count = val - ESP_MAX_BUF_CNT;
 	else
 		context->tx_buffer_count = 0;
 
-	context->adapter = esp_get_adapter();
+	/* Seed TX credits, refreshed from token once used up */
+	context->tx_credits = val - context->tx_buffer_count;
+	context->tx_inflight = 0;
 
-	if (unlikely(!context->adapter))
-		printk (KERN_ERR "%s: Failed to get adapter\n", __func__);
+	context->rx_adaptive = rx_adaptive;
+	context->rx_poll = 0;
+	context->rx_poll_usecs = RX_POLL_USECS_DEFAULT;
+	context->rx_poll_frames = RX_POLL_FRAMES_DEFAULT;
+	context->rx_idle_usecs = RX_IDLE_USECS_DEFAULT;
 
 	for (prio_q_idx=0; prio_q_idx<MAX_PRIORITY_QUEUES; prio_q_idx++) {
-		skb_queue_head_init(&(sdio_context.tx_q[prio_q_idx]));
-		atomic_set(&queue_items[prio_q_idx], 0);
+		skb_queue_head_init(&(context->tx_q[prio_q_idx]));
+		atomic_set(&context->queue_items[prio_q_idx], 0);
 	}
 
 	context->adapter->if_type = ESP_IF_TYPE_SDIO;
 
-	kfree(val);
-	return ret;
-}
+	context->tx_buf = kmalloc(ESP_TX_SLOTS * SDIO_TX_BUF_SIZE, GFP_KERNEL);
 
-static struct sk_buff * read_packet(struct esp_adapter *adapter)
-{
-	u32 len_from_slave, data_left, len_to_read, size, num_blocks;
-	int ret = 0;
-	struct sk_buff *skb;
-	u8 *pos;
-	struct esp_sdio_context *context;
+	if (!context->tx_buf)
+		return -ENOMEM;
 
-	if (!adapter || !adapter->if_context) {
-		printk (KERN_ERR "%s: INVALID args\n", __func__);
-		return NULL;
+	for (i = 0; i < ESP_TX_SLOTS; i++) {
+		slot = &context->tx_slot[i];
+		slot->context = context;
+		slot->buf = context->tx_buf + i * SDIO_TX_BUF_SIZE;
+		__skb_queue_head_init(&slot->aggr_q);
+		INIT_WORK(&slot->work, tx_slot_work);
+		init_completion(&slot->done);
 	}
 
-	context = adapter->if_context;
+	if (tx_pipeline) {
+		context->tx_wq = alloc_ordered_workqueue("esp32_sdio_tx/%d",
+				WQ_HIGHPRI | WQ_MEM_RECLAIM, context->adapter->idx);
 
-	if(!context ||  (context->state != ESP_CONTEXT_READY) || !context->func) {
-		printk(KERN_ERR "Invalid context/state\n");
-		return NULL;
+		if (!context->tx_wq)
+			ret = -ENOMEM;
 	}
 
-	sdio_claim_host(context->func);
+	return ret;
+}
+
+/* Reads all bytes pending at slave, which may hold several frames.
+ * Caller must hold the host */
+static struct sk_buff * read_packet_locked(struct esp_sdio_context *context)
+{
+	u32 len_from_slave, data_left, len_to_read, num_blocks;
+	int ret = 0;
+	struct sk_buff *skb;
+	u8 *pos;
 
 	data_left = len_to_read = len_from_slave = num_blocks = 0;
 
@@ -366,21 +647,13 @@ static struct sk_buff * read_packet(struct esp_adapter *adapter)
 	ret = esp_get_len_from_slave(context, &len_from_slave, LOCK_ALREADY_ACQUIRED);
 
 	if (ret || !len_from_slave) {
-		sdio_release_host(context->func);
 		return NULL;
 	}
 
-	size = ESP_BLOCK_SIZE * 4;
-
-	if (len_from_slave > size) {
-		printk(KERN_INFO "Rx large packet: %d\n", len_from_slave);
-	}
-
 	skb = esp_alloc_skb(len_from_slave);
 
 	if (!skb) {
 		printk (KERN_ERR "%s: SKB alloc failed\n", __func__);
-		sdio_release_host(context->func);
 		return NULL;
 	}
 
@@ -415,7 +688,6 @@ static struct sk_buff * read_packet(struct esp_adapter *adapter)
 			printk (KERN_ERR "%s: Failed to read data - %d [%u - %d]\n", __func__, ret, num_blocks, len_to_read);
 			dev_kfree_skb(skb);
 			skb = NULL;
-			sdio_release_host(context->func);
 			return NULL;
 		}
 
@@ -426,15 +698,138 @@ static struct sk_buff * read_packet(struct esp_adapter *adapter)
 
 	} while (data_left > 0);
 
+	return skb;
+}
+
+/* Length of frame at data, 0 if no valid esp_payload_header there */
+static u32 rx_frame_len(u8 *data, u32 avail)
+{
+	struct esp_payload_header *header = (struct esp_payload_header *) data;
+	u16 len, offset;
+
+	if (avail < sizeof(struct esp_payload_header))
+		return 0;
+
+	len = le16_to_cpu(header->len);
+	offset = le16_to_cpu(header->offset);
+
+	if (!len || offset != sizeof(struct esp_payload_header) || offset + len > avail)
+		return 0;
+
+	if (header->if_type >= ESP_MAX_IF || header->if_num >= ESP_MAX_INTERFACE)
+		return 0;
+
+	return offset + len;
+}
+
+/* Split data read in one pass on esp_payload_header boundaries, for
+ * slave which advertised ESP_RX_AGGREGATION. Frames after first are clones
+ * sharing data of skb, nothing is copied. Bytes which do not start a valid
+ * frame stay with frame before them */
+static int rx_deframe(struct sk_buff *skb, struct sk_buff_head *list)
+{
+	struct sk_buff *rest = NULL;
+	u32 frame_len, next;
+	int count = 1;
+
+	while (1) {
+		frame_len = rx_frame_len(skb->data, skb->len);
+		next = ALIGN(frame_len, ESP_RX_AGGR_ALIGN);
+
+		if (!frame_len || next >= skb->len ||
+		    !rx_frame_len(skb->data + next, skb->len - next))
+			break;
+
+		rest = skb_clone(skb, GFP_ATOMIC);
+		if (!rest)
+			break;
+
+		skb_trim(skb, frame_len);
+		__skb_queue_tail(list, skb);
+
+		skb_pull(rest, next);
+		skb = rest;
+		count++;
+	}
+
+	__skb_queue_tail(list, skb);
+
+	return count;
+}
+
+static struct esp_sdio_context * get_ready_context(struct esp_adapter *adapter)
+{
+	struct esp_sdio_context *context;
+
+	if (!adapter || !adapter->if_context) {
+		printk (KERN_ERR "%s: INVALID args\n", __func__);
+		return NULL;
+	}
+
+	context = adapter->if_context;
+
+	if(!context ||  (context->state != ESP_CONTEXT_READY) || !context->func) {
+		printk(KERN_ERR "Invalid context/state\n");
+		return NULL;
+	}
+
+	return context;
+}
+
+/* Whole read as one skb, read_packet_batch() is the deframing RX path */
+static struct sk_buff * read_packet(struct esp_adapter *adapter)
+{
+	struct sk_buff *skb;
+	struct esp_sdio_context *context = get_ready_context(adapter);
+
+	if (!context)
+		return NULL;
+
+	sdio_claim_host(context->func);
+	skb = read_packet_locked(context);
 	sdio_release_host(context->func);
 
 	return skb;
 }
 
+static int read_packet_batch(struct esp_adapter *adapter, struct sk_buff_head *list)
+{
+	struct sk_buff *skb;
+	struct esp_sdio_context *context = get_ready_context(adapter);
+	int count = 0;
+
+	if (!context || !list)
+		return -EINVAL;
+
+	/* Hold the host across the batch to avoid claim/release per packet */
+	sdio_claim_host(context->func);
+
+	while (count < SDIO_RX_BATCH_MAX) {
+		skb = read_packet_locked(context);
+
+		if (!skb)
+			break;
+
+		if (context->adapter->ext_capabilities & ESP_RX_AGGREGATION) {
+			count += rx_deframe(skb, list);
+		} else {
+			__skb_queue_tail(list, skb);
+			count++;
+		}
+	}
+
+	rx_adapt(context, count);
+
+	sdio_release_host(context->func);
+
+	return count;
+}
+
 static int write_packet(struct esp_adapter *adapter, struct sk_buff *skb)
 {
 	u32 max_pkt_size = ESP_RX_BUFFER_SIZE - sizeof(struct esp_payload_header);
 	struct esp_payload_header *payload_header = (struct esp_payload_header *) skb->data;
+	struct esp_sdio_context *context = NULL;
 	struct esp_skb_cb * cb = NULL;
 	uint8_t prio = PRIO_Q_LOW;
 
@@ -448,6 +843,8 @@ static int write_packet(struct esp_adapter *adapter, struct sk_buff *skb)
 		return -EINVAL;
 	}
 
+	context = adapter->if_context;
+
 	if (skb->len > max_pkt_size) {
 		printk(KERN_ERR "%s: Drop pkt of len[%u] > max SDIO transport len[%u]\n",
 				__func__, skb->len, max_pkt_size);
@@ -456,185 +853,603 @@ static int write_packet(struct esp_adapter *adapter, struct sk_buff *skb)
 		return -EPERM;
 	}
 
+	prio = esp_get_tx_prio_q(payload_header);
+
+	/* Each access category is flow controlled on its own queue depth */
 	cb = (struct esp_skb_cb *)skb->cb;
-	if (cb && cb->priv && (atomic_read(&tx_pending) >= TX_MAX_PENDING_COUNT)) {
-		esp_tx_pause(cb->priv);
-		dev_kfree_skb(skb);
-		skb = NULL;
-/*		printk(KERN_ERR "%s: TX Pause busy", __func__);*/
-		return -EBUSY;
+	if (prio >= PRIO_Q_LOW && cb && cb->priv) {
+		if (atomic_read(&context->queue_items[prio]) >= TX_MAX_PENDING_COUNT) {
+			/* Not expected, netdev queue is stopped well before */
+			esp_tx_pause(cb->priv, prio - PRIO_Q_LOW);
+			dev_kfree_skb(skb);
+			skb = NULL;
+			return -EBUSY;
+		}
+
+		/* Stop before frame is visible to tx_process, so that
+		 * its dequeue is sure to see stopped queue for resume */
+		if (atomic_read(&context->queue_items[prio]) + 1 >= TX_STOP_THRESHOLD)
+			esp_tx_pause(cb->priv, prio - PRIO_Q_LOW);
+
+		esp_tx_sent(cb->priv, prio - PRIO_Q_LOW, skb->len);
 	}
 
 	/* Enqueue SKB in tx_q */
-	atomic_inc(&tx_pending);
+	atomic_inc(&context->tx_pending);
 
 	/* Notify to process queue */
-	if (payload_header->if_type == ESP_INTERNAL_IF)
-		prio = PRIO_Q_HIGH;
-	else if (payload_header->if_type == ESP_HCI_IF)
-		prio = PRIO_Q_MID;
-	else
-		prio = PRIO_Q_LOW;
+	atomic_inc(&context->queue_items[prio]);
+	skb_queue_tail(&(context->tx_q[prio]), skb);
 
-	atomic_inc(&queue_items[prio]);
-	skb_queue_tail(&(sdio_context.tx_q[prio]), skb);
+	wake_up_interruptible(&context->tx_wait);
 
 	return 0;
 }
 
-static int tx_process(void *data)
+static int write_packet_batch(struct esp_adapter *adapter, struct sk_buff_head *list)
 {
-	int ret = 0;
-	u32 block_cnt = 0;
-	u32 buf_needed = 0, buf_available = 0;
-	u8 *pos = NULL;
-	u32 data_left, len_to_send, pad;
-	struct sk_buff *tx_skb = NULL;
-	struct esp_adapter *adapter = (struct esp_adapter *) data;
+	u32 max_pkt_size = ESP_RX_BUFFER_SIZE - sizeof(struct esp_payload_header);
+	struct esp_payload_header *payload_header = NULL;
+	struct sk_buff_head batch_q[MAX_PRIORITY_QUEUES];
 	struct esp_sdio_context *context = NULL;
 	struct esp_skb_cb * cb = NULL;
-	u8 retry;
+	struct sk_buff *skb = NULL;
+	unsigned long flags;
+	uint8_t prio = PRIO_Q_LOW;
+	u32 depth, queued = 0;
+	int ret = 0;
+
+	if (!adapter || !adapter->if_context || !list) {
+		printk(KERN_ERR "%s: Invalid args\n", __func__);
+		return -EINVAL;
+	}
 
 	context = adapter->if_context;
 
-	while (!kthread_should_stop()) {
+	for (prio = 0; prio < MAX_PRIORITY_QUEUES; prio++)
+		__skb_queue_head_init(&batch_q[prio]);
 
-		if (context->state != ESP_CONTEXT_READY) {
-			msleep(10);
-			printk(KERN_ERR "%s: not ready", __func__);
-			continue;
+	while ((skb = skb_peek(list))) {
+		if (!skb->len || skb->len > max_pkt_size) {
+			ret = -EPERM;
+			break;
 		}
 
-		if (atomic_read(&queue_items[PRIO_Q_HIGH]) > 0) {
-			tx_skb = skb_dequeue(&(context->tx_q[PRIO_Q_HIGH]));
-			if (!tx_skb) {
-				continue;
-			}
-			atomic_dec(&queue_items[PRIO_Q_HIGH]);
-		} else if (atomic_read(&queue_items[PRIO_Q_MID]) > 0) {
-			tx_skb = skb_dequeue(&(context->tx_q[PRIO_Q_MID]));
-			if (!tx_skb) {
-				continue;
-			}
-			atomic_dec(&queue_items[PRIO_Q_MID]);
-		} else if (atomic_read(&queue_items[PRIO_Q_LOW]) > 0) {
-			tx_skb = skb_dequeue(&(context->tx_q[PRIO_Q_LOW]));
-			if (!tx_skb) {
-				continue;
+		payload_header = (struct esp_payload_header *) skb->data;
+		prio = esp_get_tx_prio_q(payload_header);
+
+		cb = (struct esp_skb_cb *)skb->cb;
+		if (prio >= PRIO_Q_LOW && cb && cb->priv) {
+			depth = atomic_read(&context->queue_items[prio]) +
+				skb_queue_len(&batch_q[prio]);
+
+			if (depth >= TX_MAX_PENDING_COUNT) {
+				/* Not expected, netdev queue is stopped well before */
+				esp_tx_pause(cb->priv, prio - PRIO_Q_LOW);
+				ret = -EBUSY;
+				break;
 			}
-			atomic_dec(&queue_items[PRIO_Q_LOW]);
-		} else {
-#if 0
-			printk(KERN_ERR "%s: not ready 2 [%d %d]\n", __func__,
-					atomic_read(&queue_items[PRIO_Q_OTHERS]),
-					atomic_read(&queue_items[PRIO_Q_SERIAL]));
-#endif
-			msleep(1);
-			continue;
+
+			/* Batch is published below, after the stop */
+			if (depth + 1 >= TX_STOP_THRESHOLD)
+				esp_tx_pause(cb->priv, prio - PRIO_Q_LOW);
+
+			esp_tx_sent(cb->priv, prio - PRIO_Q_LOW, skb->len);
 		}
 
-		if (atomic_read(&tx_pending))
-			atomic_dec(&tx_pending);
+		__skb_unlink(skb, list);
+		atomic_inc(&context->tx_pending);
+
+		__skb_queue_tail(&batch_q[prio], skb);
+	}
+
+	/* Publish whole batch per queue under single lock acquisition.
+	 * queue_items is bumped after splice, as tx_process dequeues on it */
+	for (prio = 0; prio < MAX_PRIORITY_QUEUES; prio++) {
+		u32 qlen = skb_queue_len(&batch_q[prio]);
+
+		if (!qlen)
+			continue;
+
+		spin_lock_irqsave(&context->tx_q[prio].lock, flags);
+		skb_queue_splice_tail_init(&batch_q[prio], &context->tx_q[prio]);
+		spin_unlock_irqrestore(&context->tx_q[prio].lock, flags);
+
+		atomic_add(qlen, &context->queue_items[prio]);
+		queued += qlen;
+	}
+
+	if (queued)
+		wake_up_interruptible(&context->tx_wait);
+
+	return ret;
+}
+
+static u8 tx_select_queue(struct esp_sdio_context *context)
+{
+	return esp_tx_sched_select(&context->adapter->tx_sched, context->tx_q);
+}
+
+static u8 is_tx_queued(struct esp_sdio_context *context)
+{
+	u8 prio;
+
+	for (prio = 0; prio < MAX_PRIORITY_QUEUES; prio++)
+		if (atomic_read(&context->queue_items[prio]) > 0)
+			return 1;
+
+	return 0;
+}
+
+static struct sk_buff * tx_dequeue(struct esp_sdio_context *context, u8 prio)
+{
+	struct sk_buff *tx_skb = NULL;
+	struct esp_skb_cb * cb = NULL;
+
+	tx_skb = skb_dequeue(&(context->tx_q[prio]));
+	if (!tx_skb)
+		return NULL;
+
+	atomic_dec(&context->queue_items[prio]);
+
+	if (atomic_read(&context->tx_pending))
+		atomic_dec(&context->tx_pending);
 
-		retry = MAX_WRITE_RETRIES;
+	esp_tx_sched_charge(&context->adapter->tx_sched, prio, tx_skb->len);
+
+	cb = (struct esp_skb_cb *)tx_skb->cb;
+	if (prio >= PRIO_Q_LOW && cb && cb->priv) {
+		esp_tx_completed(cb->priv, prio - PRIO_Q_LOW, 1, tx_skb->len);
 
 		/* resume network tx queue if bearable load */
-		cb = (struct esp_skb_cb *)tx_skb->cb;
-		if (cb && cb->priv && atomic_read(&tx_pending) < TX_RESUME_THRESHOLD) {
-			esp_tx_resume(cb->priv);
-		}
+		if (atomic_read(&context->queue_items[prio]) < TX_RESUME_THRESHOLD)
+			esp_tx_resume(cb->priv, prio - PRIO_Q_LOW);
+	}
 
-		buf_needed = (tx_skb->len + ESP_RX_BUFFER_SIZE - 1) / ESP_RX_BUFFER_SIZE;
+	return tx_skb;
+}
 
-		while (retry) {
-			if (!context->func) {
-				retry = 0;
-				break;
-			}
+static void tx_drop(struct sk_buff *tx_skb)
+{
+	struct esp_payload_header *payload_header = (struct esp_payload_header *) tx_skb->data;
+	struct esp_skb_cb * cb = (struct esp_skb_cb *)tx_skb->cb;
+
+	if (esp_get_tx_prio_q(payload_header) >= PRIO_Q_LOW && cb->priv)
+		esp_tx_drop(cb->priv, ESP_TX_DROP_BUS_ERROR);
+
+	dev_kfree_skb(tx_skb);
+}
 
-			sdio_claim_host(context->func);
+/* Offset of next frame of len in aggregate which currently ends at end */
+static u32 tx_aggr_offset(u32 end, u32 len)
+{
+	u32 offset = ALIGN(end, ESP_TX_AGGR_ALIGN);
 
-			ret = esp_slave_get_tx_buffer_num(context, &buf_available, LOCK_ALREADY_ACQUIRED);
+	/* Frame does not fit in rest of current slave RX buffer */
+	if ((offset % ESP_RX_BUFFER_SIZE) + len > ESP_RX_BUFFER_SIZE)
+		offset = roundup(offset, ESP_RX_BUFFER_SIZE);
 
-			if (buf_available < buf_needed) {
-				sdio_release_host(context->func);
+	return offset;
+}
 
-				/* Release SDIO and retry after delay*/
-				retry--;
-				usleep_range(10,50);
-				continue;
-			}
+/* Append frames behind first one in aggr_q, as long as whole aggregate
+ * fits in max_bufs slave RX buffers */
+static void tx_aggr_collect(struct esp_sdio_context *context,
+		struct sk_buff_head *aggr_q, u32 max_bufs)
+{
+	struct sk_buff *tx_skb = NULL;
+	unsigned long flags;
+	u32 end, offset, len;
+	u8 prio;
+
+	end = skb_peek(aggr_q)->len;
+
+	while (1) {
+		prio = tx_select_queue(context);
+		if (prio == MAX_PRIORITY_QUEUES)
+			break;
+
+		/* Only this thread dequeues, so head stays until taken below */
+		spin_lock_irqsave(&context->tx_q[prio].lock, flags);
+		tx_skb = skb_peek(&context->tx_q[prio]);
+		len = tx_skb ? tx_skb->len : 0;
+		spin_unlock_irqrestore(&context->tx_q[prio].lock, flags);
+
+		if (!len)
+			break;
+
+		offset = tx_aggr_offset(end, len);
+		if (offset + len > max_bufs * ESP_RX_BUFFER_SIZE)
+			break;
 
+		tx_skb = tx_dequeue(context, prio);
+		if (!tx_skb)
 			break;
+
+		__skb_queue_tail(aggr_q, tx_skb);
+		end = offset + len;
+	}
+}
+
+/* Lay out frames of aggr_q in buf, gaps zeroed for slave to skip */
+static void tx_aggr_copy(u8 *buf, struct sk_buff_head *aggr_q)
+{
+	struct sk_buff *tx_skb = NULL;
+	u32 end = 0, offset;
+
+	skb_queue_walk(aggr_q, tx_skb) {
+		offset = tx_aggr_offset(end, tx_skb->len);
+		memset(buf + end, 0, offset - end);
+		skb_copy_bits(tx_skb, 0, buf + offset, tx_skb->len);
+		end = offset + tx_skb->len;
+	}
+}
+
+/* Length of aggr_q as laid out by tx_aggr_copy() */
+static u32 tx_aggr_len(struct sk_buff_head *aggr_q)
+{
+	struct sk_buff *tx_skb = NULL;
+	u32 end = 0;
+
+	skb_queue_walk(aggr_q, tx_skb)
+		end = tx_aggr_offset(end, tx_skb->len) + tx_skb->len;
+
+	return end;
+}
+
+static int tx_sg_add(struct scatterlist *sg, int nents, void *buf, u32 len)
+{
+	if (nents < 0 || !len)
+		return nents;
+
+	if (nents == ESP_TX_SG_MAX)
+		return -EMSGSIZE;
+
+	sg_set_buf(&sg[nents], buf, len);
+
+	return nents + 1;
+}
+
+/* Zeroes come from shared zero page */
+static int tx_sg_add_zero(struct scatterlist *sg, int nents, u32 len)
+{
+	if (nents < 0 || !len)
+		return nents;
+
+	if (nents == ESP_TX_SG_MAX)
+		return -EMSGSIZE;
+
+	sg_set_page(&sg[nents], ZERO_PAGE(0), len, 0);
+
+	return nents + 1;
+}
+
+/* Scatterlist of aggr_q in tx_aggr_copy() layout, followed by pad zero
+ * bytes. Returns number of entries, negative if frames do not fit in sg */
+static int tx_aggr_map_sg(struct scatterlist *sg, struct sk_buff_head *aggr_q, u32 pad)
+{
+	struct sk_buff *tx_skb = NULL;
+	const skb_frag_t *frag = NULL;
+	u32 end = 0, offset;
+	int nents = 0, i;
+
+	sg_init_table(sg, ESP_TX_SG_MAX);
+
+	skb_queue_walk(aggr_q, tx_skb) {
+		if (skb_has_frag_list(tx_skb))
+			return -EMSGSIZE;
+
+		offset = tx_aggr_offset(end, tx_skb->len);
+		nents = tx_sg_add_zero(sg, nents, offset - end);
+		nents = tx_sg_add(sg, nents, tx_skb->data, skb_headlen(tx_skb));
+
+		/* NETIF_F_HIGHDMA is not advertised, so frags are in lowmem */
+		for (i = 0; i < skb_shinfo(tx_skb)->nr_frags; i++) {
+			frag = &skb_shinfo(tx_skb)->frags[i];
+			nents = tx_sg_add(sg, nents, skb_frag_address(frag),
+					skb_frag_size(frag));
 		}
 
-		if (!retry) {
-			/* No buffer available at slave */
-			dev_kfree_skb(tx_skb);
-			tx_skb = NULL;
+		end = offset + tx_skb->len;
+	}
+
+	nents = tx_sg_add_zero(sg, nents, pad);
+
+	if (nents > 0)
+		sg_mark_end(&sg[nents - 1]);
+
+	return nents;
+}
+
+/* Gather aggr_q in buf, unless single frame can go out as is. Block
+ * padding is written too, so it has to fit in tail room of skb */
+static u8 * tx_linearize(u8 *buf, struct sk_buff_head *aggr_q, u32 len, u32 pad)
+{
+	struct sk_buff *tx_skb = skb_peek(aggr_q);
+
+	if (skb_queue_len(aggr_q) > 1) {
+		tx_aggr_copy(buf, aggr_q);
+		memset(buf + len, 0, pad);
+		return buf;
+	}
+
+	if (skb_is_nonlinear(tx_skb) ||
+	    !IS_ALIGNED((unsigned long) tx_skb->data, SKB_DATA_ADDR_ALIGNMENT) ||
+	    skb_tailroom(tx_skb) < pad) {
+		/* Gather header and frags into DMA safe buffer */
+		skb_copy_bits(tx_skb, 0, buf, len);
+		memset(buf + len, 0, pad);
+		return buf;
+	}
+
+	return tx_skb->data;
+}
+
+/* Blocks until slave has buf_needed free RX buffers. Credits are taken
+ * from token register only once host side count runs out, less buffers
+ * of slots not reaped yet. Returns error if device is going away */
+static int tx_wait_for_credits(struct esp_sdio_context *context, u32 buf_needed)
+{
+	u32 spins = 0, avail = 0;
+	int ret = 0;
+
+	while (1) {
+		if (context->tx_credits >= buf_needed)
+			return 0;
+
+		if (!context->func || context->state != ESP_CONTEXT_READY ||
+		    kthread_should_stop())
+			return -ENODEV;
+
+		ret = esp_slave_get_tx_buffer_num(context, &avail, ACQUIRE_LOCK);
+
+		if (!ret)
+			context->tx_credits = avail > context->tx_inflight ?
+				avail - context->tx_inflight : 0;
+
+		if (context->tx_credits >= buf_needed)
+			return 0;
+
+		if (spins < TX_CREDIT_SPINS) {
+			spins++;
+			usleep_range(10,50);
 			continue;
 		}
 
-		pos = tx_skb->data;
-		data_left = len_to_send = 0;
+		/* Slave is backed up, retry on its next interrupt or timeout */
+		wait_event_interruptible_timeout(context->tx_wait,
+				atomic_read(&context->tx_credit_kick) || kthread_should_stop(),
+				msecs_to_jiffies(TX_CREDIT_WAIT_MS));
+		atomic_set(&context->tx_credit_kick, 0);
+	}
+}
 
-		data_left = tx_skb->len;
-		pad = ESP_BLOCK_SIZE - (data_left % ESP_BLOCK_SIZE);
-		data_left += pad;
+/* Lays out frames of slot for transfer, while other slot is on the bus */
+static void tx_slot_prepare(struct esp_tx_slot *slot)
+{
+	if (skb_queue_len(&slot->aggr_q) > 1) {
+		slot->data_len = tx_aggr_len(&slot->aggr_q);
+
+		/* Zeroed tail, block padding stays within last buffer */
+		slot->pad = ALIGN(slot->data_len, ESP_BLOCK_SIZE) - slot->data_len;
+	} else {
+		slot->data_len = skb_peek(&slot->aggr_q)->len;
+		slot->pad = ESP_BLOCK_SIZE - (slot->data_len % ESP_BLOCK_SIZE);
+	}
 
+	slot->buf_needed = DIV_ROUND_UP(slot->data_len, ESP_RX_BUFFER_SIZE);
+	slot->nents = tx_sg ? tx_aggr_map_sg(slot->sg, &slot->aggr_q, slot->pad) : 0;
+	slot->pos = NULL;
 
-		do {
-			block_cnt = data_left / ESP_BLOCK_SIZE;
-			len_to_send = data_left;
-			ret = esp_write_block(context, ESP_SLAVE_CMD53_END_ADDR - len_to_send,
-					pos, (len_to_send + 3) & (~3), LOCK_ALREADY_ACQUIRED);
+	if (slot->nents <= 0)
+		slot->pos = tx_linearize(slot->buf, &slot->aggr_q,
+				slot->data_len, slot->pad);
+}
 
-			if (ret) {
-				printk (KERN_ERR "%s: Failed to send data: %d %d %d\n", __func__, ret, len_to_send, data_left);
-				sdio_release_host(context->func);
-				break;
-			}
+/* Caller must hold the host */
+static int tx_slot_write(struct esp_tx_slot *slot)
+{
+	struct esp_sdio_context *context = slot->context;
+	u32 len = slot->data_len + slot->pad;
+	int ret = -E2BIG;
+
+	if (slot->nents > 0)
+		ret = esp_write_block_sg(context, ESP_SLAVE_CMD53_END_ADDR - len,
+				slot->sg, slot->nents, len, LOCK_ALREADY_ACQUIRED);
+
+	if (ret == -E2BIG) {
+		/* Beyond host limits for scatterlist, send from one buffer */
+		if (!slot->pos)
+			slot->pos = tx_linearize(slot->buf, &slot->aggr_q,
+					slot->data_len, slot->pad);
+
+		ret = esp_write_block(context, ESP_SLAVE_CMD53_END_ADDR - len,
+				slot->pos, (len + 3) & (~3), LOCK_ALREADY_ACQUIRED);
+	}
 
-			data_left -= len_to_send;
-			pos += len_to_send;
-		} while (data_left);
+	return ret;
+}
+
+/* Runs on tx_wq in pipeline mode, else inline in tx_process */
+static void tx_slot_work(struct work_struct *work)
+{
+	struct esp_tx_slot *slot = container_of(work, struct esp_tx_slot, work);
+	struct esp_sdio_context *context = slot->context;
+
+	sdio_claim_host(context->func);
+	slot->ret = tx_slot_write(slot);
+	sdio_release_host(context->func);
+
+	complete(&slot->done);
+}
+
+/* Waits for write of slot, then accounts and frees its frames */
+static void tx_slot_reap(struct esp_sdio_context *context, struct esp_tx_slot *slot)
+{
+	struct sk_buff *tx_skb = NULL;
+
+	if (!slot->busy)
+		return;
+
+	wait_for_completion(&slot->done);
+	slot->busy = 0;
+	context->tx_inflight -= slot->buf_needed;
+
+	if (slot->ret) {
+		printk (KERN_ERR "%s: Failed to send data: %d %d\n", __func__,
+				slot->ret, slot->data_len);
+
+		/* drop the packets, slave may have taken buffers anyway */
+		context->tx_credits = 0;
+		while ((tx_skb = __skb_dequeue(&slot->aggr_q)))
+			tx_drop(tx_skb);
+		return;
+	}
+
+	context->tx_buffer_count += slot->buf_needed;
+	context->tx_buffer_count = context->tx_buffer_count % ESP_TX_BUFFER_MAX;
+
+	while ((tx_skb = __skb_dequeue(&slot->aggr_q)))
+		dev_kfree_skb(tx_skb);
+}
+
+static void tx_reap_all(struct esp_sdio_context *context)
+{
+	u8 i;
+
+	for (i = 0; i < ESP_TX_SLOTS; i++)
+		tx_slot_reap(context, &context->tx_slot[i]);
+}
+
+static int tx_process(void *data)
+{
+	int ret = 0;
+	u32 buf_needed = 0;
+	struct sk_buff *tx_skb = NULL;
+	struct esp_adapter *adapter = (struct esp_adapter *) data;
+	struct esp_sdio_context *context = NULL;
+	struct esp_tx_slot *slot = NULL;
+	u8 slot_idx = 0;
+	u8 prio;
+
+	context = adapter->if_context;
+
+	while (!kthread_should_stop()) {
+
+		if (context->state != ESP_CONTEXT_READY) {
+			msleep(10);
+			printk(KERN_ERR "%s: not ready", __func__);
+			continue;
+		}
+
+		prio = tx_select_queue(context);
+
+		if (prio == MAX_PRIORITY_QUEUES) {
+			/* Sent frames are freed before going idle */
+			tx_reap_all(context);
+
+			/* Woken by write_packet*() or kthread_stop() */
+			wait_event_interruptible(context->tx_wait,
+					is_tx_queued(context) || kthread_should_stop());
+			continue;
+		}
+
+		/* In pipeline mode, slot was submitted two rounds back */
+		slot = &context->tx_slot[slot_idx];
+		tx_slot_reap(context, slot);
+
+		tx_skb = tx_dequeue(context, prio);
+		if (!tx_skb) {
+			continue;
+		}
+
+		buf_needed = (tx_skb->len + ESP_RX_BUFFER_SIZE - 1) / ESP_RX_BUFFER_SIZE;
+
+		ret = tx_wait_for_credits(context, buf_needed);
 
 		if (ret) {
-			/* drop the packet */
-			dev_kfree_skb(tx_skb);
+			/* Device is going away */
+			tx_drop(tx_skb);
 			tx_skb = NULL;
 			continue;
 		}
 
-		context->tx_buffer_count += buf_needed;
-		context->tx_buffer_count = context->tx_buffer_count % ESP_TX_BUFFER_MAX;
-
-		sdio_release_host(context->func);
-		dev_kfree_skb(tx_skb);
+		__skb_queue_tail(&slot->aggr_q, tx_skb);
 		tx_skb = NULL;
+
+		if (adapter->ext_capabilities & ESP_TX_AGGREGATION)
+			tx_aggr_collect(context, &slot->aggr_q,
+					min_t(u32, context->tx_credits, ESP_TX_AGGR_MAX_BUFS));
+
+		tx_slot_prepare(slot);
+
+		context->tx_credits -= slot->buf_needed;
+		context->tx_inflight += slot->buf_needed;
+		slot->busy = 1;
+		reinit_completion(&slot->done);
+
+		if (context->tx_wq) {
+			queue_work(context->tx_wq, &slot->work);
+			slot_idx = (slot_idx + 1) % ESP_TX_SLOTS;
+		} else {
+			tx_slot_work(&slot->work);
+			tx_slot_reap(context, slot);
+		}
 	}
 
+	tx_reap_all(context);
+
 	do_exit(0);
 	return 0;
 }
 
-static struct esp_sdio_context * init_sdio_func(struct sdio_func *func)
+static struct esp_sdio_context * init_sdio_func(struct sdio_func *func,
+		struct esp_adapter *adapter)
 {
 	struct esp_sdio_context *context = NULL;
 	int ret = 0;
 
-	if (!func)
+	if (!func || !adapter)
+		return NULL;
+
+	context = kzalloc(sizeof(struct esp_sdio_context), GFP_KERNEL);
+
+	if (!context)
+		return NULL;
+
+	/* Needed by ISR, so allocated before IRQ is claimed */
+	context->reg_buf = kmalloc(ESP_REG_BUF_SIZE, GFP_KERNEL);
+
+	if (!context->reg_buf) {
+		kfree(context);
 		return NULL;
+	}
+
+	/* ISR wakes TX thread waiting for credits */
+	init_waitqueue_head(&context->tx_wait);
 
-	context = &sdio_context;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0))
+	hrtimer_setup(&context->rx_poll_timer, rx_poll_timer_cb,
+			CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+	hrtimer_init(&context->rx_poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	context->rx_poll_timer.function = rx_poll_timer_cb;
+#endif
 
 	context->func = func;
+	context->adapter = adapter;
+
+	adapter->if_context = context;
+	adapter->if_ops = &if_ops;
 
 	sdio_claim_host(func);
 
 	/* Enable Function */
 	ret = sdio_enable_func(func);
 	if (ret) {
+		sdio_release_host(func);
+		kfree(context->reg_buf);
+		kfree(context);
 		return NULL;
 	}
 
@@ -642,6 +1457,9 @@ static struct esp_sdio_context * init_sdio_func(struct sdio_func *func)
 	ret = sdio_claim_irq(func, esp_handle_isr);
 	if (ret) {
 		sdio_disable_func(func);
+		sdio_release_host(func);
+		kfree(context->reg_buf);
+		kfree(context);
 		return NULL;
 	}
 
@@ -667,19 +1485,16 @@ static int monitor_process(void *data)
 
 		val = intr = len_reg = rdata = 0;
 
-		esp_read_reg(context, ESP_SLAVE_PACKET_LEN_REG,
-				(u8 *) &val, sizeof(val), ACQUIRE_LOCK);
+		esp_read_reg32(context, ESP_SLAVE_PACKET_LEN_REG, &val, ACQUIRE_LOCK);
 
 		len_reg = val & ESP_SLAVE_LEN_MASK;
 
 		val = 0;
-		esp_read_reg(context, ESP_SLAVE_TOKEN_RDATA, (u8 *) &val,
-				sizeof(val), ACQUIRE_LOCK);
+		esp_read_reg32(context, ESP_SLAVE_TOKEN_RDATA, &val, ACQUIRE_LOCK);
 
 		rdata = ((val >> 16) & ESP_TX_BUFFER_MASK);
 
-		esp_read_reg(context, ESP_SLAVE_INT_ST_REG,
-				(u8 *) &intr, sizeof(intr), ACQUIRE_LOCK);
+		esp_read_reg32(context, ESP_SLAVE_INT_ST_REG, &intr, ACQUIRE_LOCK);
 
 
 		if (len_reg > context->rx_byte_count) {
@@ -714,6 +1529,7 @@ static int esp_probe(struct sdio_func *func,
 				  const struct sdio_device_id *id)
 {
 	struct esp_sdio_context *context = NULL;
+	struct esp_adapter *adapter = NULL;
 	int ret = 0;
 
 	if (func->num != 1) {
@@ -722,34 +1538,53 @@ static int esp_probe(struct sdio_func *func,
 
 	printk(KERN_INFO "%s: ESP network device detected\n", __func__);
 
-	context = init_sdio_func(func);
+	adapter = esp_alloc_adapter();
+
+	if (!adapter) {
+		return -ENOMEM;
+	}
+
+	context = init_sdio_func(func, adapter);
 
 	if (!context) {
+		esp_free_adapter(adapter);
 		return -ENOMEM;
 	}
 
 	context->state = ESP_CONTEXT_READY;
-	atomic_set(&tx_pending, 0);
+	atomic_set(&context->tx_pending, 0);
 	ret = init_context(context);
 	if (ret) {
 		deinit_sdio_func(func);
+		esp_free_adapter(adapter);
+		if (context->tx_wq)
+			destroy_workqueue(context->tx_wq);
+		kfree(context->tx_buf);
+		kfree(context->reg_buf);
+		kfree(context);
 		return ret;
 	}
 
-	tx_thread = kthread_run(tx_process, context->adapter, "esp32_TX");
+	context->tx_thread = kthread_run(tx_process, adapter, "esp32_TX/%d",
+			adapter->idx);
 
-	if (!tx_thread)
+	if (IS_ERR(context->tx_thread)) {
 		printk (KERN_ERR "Failed to create esp32_sdio TX thread\n");
+		context->tx_thread = NULL;
+	}
 
-	context->adapter->dev = &func->dev;
+	adapter->dev = &func->dev;
 	generate_slave_intr(context, BIT(ESP_OPEN_DATA_PATH));
 
 
 #ifdef CONFIG_ENABLE_MONITOR_PROCESS
-	monitor_thread = kthread_run(monitor_process, context, "Monitor process");
+	context->monitor_thread = kthread_run(monitor_process, context,
+			"Monitor process/%d", adapter->idx);
 
-	if (!monitor_thread)
+	if (IS_ERR(context->monitor_thread)) {
 		printk (KERN_ERR "Failed to create monitor thread\n");
+		context->monitor_thread = NULL;
+	}
 #endif
 
 	return ret;
@@ -763,15 +1598,8 @@ static struct sdio_driver esp_sdio_driver = {
 	.remove		= esp_remove,
 };
 
-int esp_init_interface_layer(struct esp_adapter *adapter)
+int esp_init_interface_layer(void)
 {
-	if (!adapter)
-		return -EINVAL;
-
-	adapter->if_context = &sdio_context;
-	adapter->if_ops = &if_ops;
-	sdio_context.adapter = adapter;
-
 	return sdio_register_driver(&esp_sdio_driver);
 }
 
@@ -779,11 +1607,13 @@ void process_event_esp_bootup(struct esp_adapter *adapter, u8 *evt_buf, u8 len)
 {
 	u8 len_left = len, tag_len;
 	u8 *pos;
-	struct esp_sdio_context *context = &sdio_context;
+	struct esp_sdio_context *context = NULL;
 
 	if (!adapter)
 		return;
 
+	context = adapter->if_context;
+
 	if (!evt_buf)
 		return;
 
@@ -812,6 +1642,10 @@ void process_event_esp_bootup(struct esp_adapter *adapter, u8 *evt_buf, u8 len)
 			if (*(pos+2)!=ESP_FIRMWARE_CHIP_ESP32)
 				printk(KERN_ERR "SDIO is only supported with ESP32\n");
 
+		} else if (*pos == ESP_BOOTUP_CAPABILITY_EXT) {
+
+			process_ext_capabilities(adapter, pos + 2, tag_len);
+
 		} else if (*pos == ESP_BOOTUP_FW_DATA) {
 
 			if (tag_len != sizeof(struct fw_data))
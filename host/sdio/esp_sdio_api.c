@@ -158,3 +158,70 @@ int esp_write_block(struct esp_sdio_context *context, u32 reg, u8 *data, u16 siz
 	}
 }
 
+/* CMD53 in block mode from scatterlist, so that frame fragments and padding
+ * go out without being gathered in one buffer. Returns -E2BIG if request
+ * is beyond host limits, caller then falls back to esp_write_block() */
+int esp_write_block_sg(struct esp_sdio_context *context, u32 reg,
+		struct scatterlist *sg, unsigned int sg_len, u32 size, u8 is_lock_needed)
+{
+	struct mmc_request mrq = {};
+	struct mmc_command cmd = {};
+	struct mmc_data data = {};
+	struct sdio_func *func = NULL;
+	struct mmc_host *host = NULL;
+	u32 blksz, blocks;
+	int ret = 0;
+
+	if (!context || !context->func || !sg || !sg_len) {
+		printk (KERN_ERR "%s: Invalid or incomplete arguments!\n", __func__);
+		return -1;
+	}
+
+	func = context->func;
+	host = func->card->host;
+	blksz = func->cur_blksize;
+	blocks = size / blksz;
+
+	/* CMD53 block count field is 9 bits */
+	if (!blocks || (size % blksz) || blocks > min_t(u32, host->max_blk_count, 511) ||
+	    size > host->max_req_size || sg_len > host->max_segs)
+		return -E2BIG;
+
+	cmd.opcode = SD_IO_RW_EXTENDED;
+	cmd.arg = 0x80000000;			/* write */
+	cmd.arg |= func->num << 28;
+	cmd.arg |= 0x08000000;			/* block mode */
+	cmd.arg |= 0x04000000;			/* incrementing address */
+	cmd.arg |= (reg & 0x1FFFF) << 9;
+	cmd.arg |= blocks;
+	cmd.flags = MMC_RSP_SPI_R5 | MMC_RSP_R5 | MMC_CMD_ADTC;
+
+	data.blksz = blksz;
+	data.blocks = blocks;
+	data.flags = MMC_DATA_WRITE;
+	data.sg = sg;
+	data.sg_len = sg_len;
+
+	mrq.cmd = &cmd;
+	mrq.data = &data;
+
+	mmc_set_data_timeout(&data, func->card);
+
+	if (is_lock_needed)
+		sdio_claim_host(func);
+
+	mmc_wait_for_req(host, &mrq);
+
+	if (is_lock_needed)
+		sdio_release_host(func);
+
+	if (cmd.error)
+		ret = cmd.error;
+	else if (data.error)
+		ret = data.error;
+	else if (!mmc_host_is_spi(host) &&
+		 (cmd.resp[0] & (R5_ERROR | R5_FUNCTION_NUMBER | R5_OUT_OF_RANGE)))
+		ret = -EIO;
+
+	return ret;
+}
@@ -25,5 +25,7 @@ int esp_read_reg(struct esp_sdio_context *context, u32 reg, u8 *data, u16 size,
 int esp_read_block(struct esp_sdio_context *context, u32 reg, u8 *data, u16 size, u8 is_lock_needed);
 int esp_write_reg(struct esp_sdio_context *context, u32 reg, u8 *data, u16 size, u8 is_lock_needed);
 int esp_write_block(struct esp_sdio_context *context, u32 reg, u8 *data, u16 size, u8 is_lock_needed);
+int esp_write_block_sg(struct esp_sdio_context *context, u32 reg,
+		struct scatterlist *sg, unsigned int sg_len, u32 size, u8 is_lock_needed);
 
 #endif
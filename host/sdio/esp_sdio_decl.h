@@ -20,6 +20,10 @@
 #ifndef _ESP_DECL_H_
 #define _ESP_DECL_H_
 
+#include <linux/scatterlist.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/hrtimer.h>
 #include "esp.h"
 
 /* Interrupt Status */
@@ -46,6 +50,20 @@
 #define ESP_TX_BUFFER_MAX              0x1000
 #define ESP_MAX_BUF_CNT                10
 
+/* Entries of TX scatterlist: frame heads, frags, gaps and padding */
+#define ESP_TX_SG_MAX                  128
+/* One TX transfer on the bus while next one is prepared */
+#define ESP_TX_SLOTS                   2
+
+/* TOKEN_RDATA up to PACKET_LEN_REG, fetched by one CMD53 in snapshot mode */
+#define ESP_SLAVE_SNAPSHOT_START       ESP_SLAVE_TOKEN_RDATA
+#define ESP_SLAVE_SNAPSHOT_LEN         (ESP_SLAVE_PACKET_LEN_REG + 4 - ESP_SLAVE_SNAPSHOT_START)
+#define ESP_SNAPSHOT_OFFSET(reg)       ((reg) - ESP_SLAVE_SNAPSHOT_START)
+
+/* Register I/O goes through a bounce buffer of its own cacheline(s), as
+ * SDIO host may DMA into it */
+#define ESP_REG_BUF_SIZE               max_t(u32, L1_CACHE_BYTES, ESP_SLAVE_SNAPSHOT_LEN)
+
 #define ESP_SLAVE_SLCHOST_BASE         0x3FF55000
 
 #define ESP_SLAVE_SCRATCH_REG_7        (ESP_SLAVE_SLCHOST_BASE + 0x8C)
@@ -54,6 +72,7 @@
 #define ESP_SLAVE_INT_RAW_REG          (ESP_SLAVE_SLCHOST_BASE + 0x50)
 #define ESP_SLAVE_INT_ST_REG           (ESP_SLAVE_SLCHOST_BASE + 0x58)
 #define ESP_SLAVE_INT_CLR_REG          (ESP_SLAVE_SLCHOST_BASE + 0xD4)
+#define ESP_SLAVE_INT_ENA_REG          (ESP_SLAVE_SLCHOST_BASE + 0xDC)
 
 /* Data path registers*/
 #define ESP_SLAVE_PACKET_LEN_REG       (ESP_SLAVE_SLCHOST_BASE + 0x60)
@@ -82,6 +101,32 @@
 #define ESP_DEVICE_ID_2               0x3333
 
 
+/* Register values kept from last snapshot */
+enum esp_snapshot_idx {
+	ESP_SNAP_TOKEN,
+	ESP_SNAP_PACKET_LEN,
+	ESP_SNAP_MAX,
+};
+
+struct esp_sdio_context;
+
+/* One CMD53 worth of TX frames */
+struct esp_tx_slot {
+	struct esp_sdio_context *context;
+	struct sk_buff_head    aggr_q;
+	u8                     *buf;
+	u8                     *pos;
+	struct scatterlist     sg[ESP_TX_SG_MAX];
+	int                    nents;
+	u32                    data_len;
+	u32                    pad;
+	u32                    buf_needed;
+	struct work_struct     work;
+	struct completion      done;
+	int                    ret;
+	u8                     busy;
+};
+
 enum context_state {
 	ESP_CONTEXT_DISABLED = 0,
 	ESP_CONTEXT_INIT,
@@ -93,8 +138,39 @@ struct esp_sdio_context {
 	struct sdio_func       *func;
 	enum context_state     state;
 	struct sk_buff_head    tx_q[MAX_PRIORITY_QUEUES];
+	atomic_t               queue_items[MAX_PRIORITY_QUEUES];
+	atomic_t               tx_pending;
+	struct task_struct     *tx_thread;
+	/* tx_thread sleeps here while all tx_q are empty */
+	wait_queue_head_t      tx_wait;
+	u8                     *tx_buf;
+	struct esp_tx_slot     tx_slot[ESP_TX_SLOTS];
+	/* Pipeline mode, runs slot writes */
+	struct workqueue_struct *tx_wq;
+	/* Register I/O bounce buffer, only touched with host claimed */
+	u8                     *reg_buf;
+#ifdef CONFIG_ENABLE_MONITOR_PROCESS
+	struct task_struct     *monitor_thread;
+#endif
 	u32                    rx_byte_count;
 	u32                    tx_buffer_count;
+	/* Free slave RX buffers known to host, owned by tx_thread */
+	u32                    tx_credits;
+	/* Buffers of slots submitted but not reaped */
+	u32                    tx_inflight;
+	atomic_t               tx_credit_kick;
+	/* Adaptive RX: RX_NEW_PACKET masked and slave polled while busy.
+	 * Changed with host claimed */
+	u8                     rx_adaptive;
+	u8                     rx_poll;
+	u32                    rx_poll_usecs;
+	u32                    rx_poll_frames;
+	u32                    rx_idle_usecs;
+	ktime_t                rx_last_data;
+	struct hrtimer         rx_poll_timer;
+	/* Snapshot mode, each value is used at most once */
+	u32                    snap_val[ESP_SNAP_MAX];
+	u8                     snap_valid;
 };
 
 #endif
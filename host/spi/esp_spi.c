@@ -19,62 +19,152 @@
 #include <linux/gpio.h>
 #include <linux/mutex.h>
 #include <linux/delay.h>
+#include <linux/sched.h>
+#include <linux/version.h>
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0))
+#include <linux/sched/types.h>
+#endif
 #include "esp_spi.h"
 #include "esp_if.h"
 #include "esp_api.h"
 #include "esp_bt_api.h"
+#include "esp_tx_sched.h"
+
+#if (LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0))
+#define reinit_completion(x)    INIT_COMPLETION(*(x))
+#endif
 
 #define SPI_INITIAL_CLK_MHZ     10
+/* Consecutive failed transactions that lower SPI clock */
+#define SPI_CLK_ERR_THRESHOLD   3
 #define NUMBER_1M               1000000
+/* Per AC data queue. Netdev queue is stopped at TX_STOP_THRESHOLD, which
+ * leaves room for a TX batch already taken from stack */
 #define TX_MAX_PENDING_COUNT    100
+#define TX_STOP_THRESHOLD       (TX_MAX_PENDING_COUNT - ESP_TX_BATCH_MAX)
 #define TX_RESUME_THRESHOLD     (TX_MAX_PENDING_COUNT/5)
 
+/* Use variable length transfers if firmware supports them */
+static bool spi_var_len = true;
+module_param(spi_var_len, bool, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(spi_var_len, "Cut SPI transfers to frame length when firmware advertises support");
+
+/* Overlap transaction on the wire with reaping and staging of others */
+static bool spi_pipeline;
+module_param(spi_pipeline, bool, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(spi_pipeline, "Run SPI transactions asynchronously, two slots");
+
+/* Transactions from IRQ threads instead of spi_workqueue */
+static bool spi_irq_thread;
+module_param(spi_irq_thread, bool, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(spi_irq_thread, "Run SPI transactions from threaded IRQ of handshake and data ready lines");
+
+static bool spi_irq_fifo = true;
+module_param(spi_irq_fifo, bool, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(spi_irq_fifo, "Keep IRQ threads SCHED_FIFO, else SCHED_NORMAL");
+
+static bool spi_irq_latency;
+module_param(spi_irq_latency, bool, S_IRUSR | S_IRGRP | S_IROTH);
+MODULE_PARM_DESC(spi_irq_latency, "Measure IRQ to transaction latency, see irq_latency_* in sysfs");
+
 static struct sk_buff * read_packet(struct esp_adapter *adapter);
 static int write_packet(struct esp_adapter *adapter, struct sk_buff *skb);
-static void spi_exit(void);
-static int spi_init(void);
-static void adjust_spi_clock(u8 spi_clk_mhz);
+static int read_packet_batch(struct esp_adapter *adapter, struct sk_buff_head *list);
+static int write_packet_batch(struct esp_adapter *adapter, struct sk_buff_head *list);
+static void spi_exit(struct esp_spi_context *context);
+static void spi_slots_drain(struct esp_spi_context *context);
+static int spi_init(struct esp_spi_context *context);
+static void adjust_spi_clock(struct esp_spi_context *context, u8 spi_clk_mhz);
 
-volatile u8 data_path = 0;
-static struct esp_spi_context spi_context;
-static char hardware_type = 0;
-static atomic_t tx_pending;
-static uint8_t esp_reset_after_module_load;
+/* Handshake and data ready lines are fixed (see esp_spi.h), so one device
+ * is registered at module load. Kept only to tear it down at module exit */
+static struct esp_spi_context *esp_spi_ctx;
 
 static struct esp_if_ops if_ops = {
 	.read		= read_packet,
 	.write		= write_packet,
+	.read_batch	= read_packet_batch,
+	.write_batch	= write_packet_batch,
 };
 
-static DEFINE_MUTEX(spi_lock);
-
-static void open_data_path(void)
+static void open_data_path(struct esp_spi_context *context)
 {
-	atomic_set(&tx_pending, 0);
+	atomic_set(&context->tx_pending, 0);
 	msleep(200);
-	data_path = OPEN_DATAPATH;
+	context->data_path = OPEN_DATAPATH;
 }
 
-static void close_data_path(void)
+static void close_data_path(struct esp_spi_context *context)
 {
-	data_path = CLOSE_DATAPATH;
+	context->data_path = CLOSE_DATAPATH;
 	msleep(200);
 }
 
+/* Gets transactions going, from any context */
+static void spi_kick(struct esp_spi_context *context)
+{
+	if (spi_irq_thread)
+		irq_wake_thread(SPI_IRQ, context);
+	else if (context->spi_workqueue)
+		queue_work(context->spi_workqueue, &context->spi_work);
+}
+
+/* Oldest IRQ not yet followed by transaction */
+static void spi_irq_stamp(struct esp_spi_context *context)
+{
+	if (spi_irq_latency)
+		atomic64_cmpxchg(&context->irq_stamp, 0, ktime_to_ns(ktime_get()));
+}
+
+/* Caller holds spi_lock */
+static void spi_irq_latency_sample(struct esp_spi_context *context)
+{
+	s64 stamp = 0;
+	u64 delta = 0;
+
+	if (!spi_irq_latency)
+		return;
+
+	stamp = atomic64_xchg(&context->irq_stamp, 0);
+	if (!stamp)
+		return;
+
+	delta = ktime_to_ns(ktime_get()) - stamp;
+
+	context->irq_lat_samples++;
+	context->irq_lat_total_ns += delta;
+	if (delta > context->irq_lat_max_ns)
+		context->irq_lat_max_ns = delta;
+}
+
 static irqreturn_t spi_data_ready_interrupt_handler(int irq, void * dev)
 {
+	struct esp_spi_context *context = dev;
+
+	spi_irq_stamp(context);
+
+	if (spi_irq_thread)
+		return IRQ_WAKE_THREAD;
+
 	/* ESP peripheral has queued buffer for transmission */
- 	if (spi_context.spi_workqueue)
- 		queue_work(spi_context.spi_workqueue, &spi_context.spi_work);
+ 	if (context->spi_workqueue)
+ 		queue_work(context->spi_workqueue, &context->spi_work);
 
  	return IRQ_HANDLED;
  }
 
 static irqreturn_t spi_interrupt_handler(int irq, void * dev)
 {
+	struct esp_spi_context *context = dev;
+
+	spi_irq_stamp(context);
+
+	if (spi_irq_thread)
+		return IRQ_WAKE_THREAD;
+
 	/* ESP peripheral is ready for next SPI transaction */
-	if (spi_context.spi_workqueue)
-		queue_work(spi_context.spi_workqueue, &spi_context.spi_work);
+	if (context->spi_workqueue)
+		queue_work(context->spi_workqueue, &context->spi_work);
 
 	return IRQ_HANDLED;
 }
@@ -84,10 +174,6 @@ static struct sk_buff * read_packet(struct esp_adapter *adapter)
 	struct esp_spi_context *context;
 	struct sk_buff *skb = NULL;
 
-	if (!data_path) {
-		return NULL;
-	}
-
 	if (!adapter || !adapter->if_context) {
 		printk (KERN_ERR "%s: Invalid args\n", __func__);
 		return NULL;
@@ -95,6 +181,10 @@ static struct sk_buff * read_packet(struct esp_adapter *adapter)
 
 	context = adapter->if_context;
 
+	if (!context->data_path) {
+		return NULL;
+	}
+
 	if (context->esp_spi_dev) {
 		skb = skb_dequeue(&(context->rx_q[PRIO_Q_HIGH]));
 		if (!skb)
@@ -109,11 +199,47 @@ static struct sk_buff * read_packet(struct esp_adapter *adapter)
 	return skb;
 }
 
+static int read_packet_batch(struct esp_adapter *adapter, struct sk_buff_head *list)
+{
+	struct esp_spi_context *context;
+	unsigned long flags;
+	int count = 0;
+	u8 prio;
+
+	if (!adapter || !adapter->if_context || !list) {
+		printk (KERN_ERR "%s: Invalid args\n", __func__);
+		return -EINVAL;
+	}
+
+	context = adapter->if_context;
+
+	if (!context->data_path) {
+		return 0;
+	}
+
+	if (!context->esp_spi_dev) {
+		printk (KERN_ERR "%s: Invalid args\n", __func__);
+		return -EINVAL;
+	}
+
+	/* Move everything received so far, highest priority first */
+	for (prio = PRIO_Q_HIGH; prio < MAX_PRIORITY_QUEUES; prio++) {
+		spin_lock_irqsave(&context->rx_q[prio].lock, flags);
+		count += skb_queue_len(&context->rx_q[prio]);
+		skb_queue_splice_tail_init(&context->rx_q[prio], list);
+		spin_unlock_irqrestore(&context->rx_q[prio].lock, flags);
+	}
+
+	return count;
+}
+
 static int write_packet(struct esp_adapter *adapter, struct sk_buff *skb)
 {
 	u32 max_pkt_size = SPI_BUF_SIZE - sizeof(struct esp_payload_header);
 	struct esp_payload_header *payload_header = (struct esp_payload_header *) skb->data;
+	struct esp_spi_context *context = NULL;
 	struct esp_skb_cb * cb = NULL;
+	u8 prio;
 
 	if (!adapter || !adapter->if_context || !skb || !skb->data || !skb->len) {
 		printk (KERN_ERR "%s: Invalid args\n", __func__);
@@ -124,6 +250,8 @@ static int write_packet(struct esp_adapter *adapter, struct sk_buff *skb)
 		return -EINVAL;
 	}
 
+	context = adapter->if_context;
+
 	if (skb->len > max_pkt_size) {
 		printk (KERN_ERR "%s: Drop pkt of len[%u] > max spi transport len[%u]\n",
 				__func__, skb->len, max_pkt_size);
@@ -131,42 +259,124 @@ static int write_packet(struct esp_adapter *adapter, struct sk_buff *skb)
 		return -EPERM;
 	}
 
-	if (!data_path) {
+	if (!context->data_path) {
 		/*printk(KERN_INFO "%s:%u datapath closed\n",__func__,__LINE__);*/
 		dev_kfree_skb(skb);
 		return -EPERM;
 	}
 
+	prio = esp_get_tx_prio_q(payload_header);
+
+	/* Each access category is flow controlled on its own queue depth */
 	cb = (struct esp_skb_cb *)skb->cb;
-	if (cb && cb->priv && (atomic_read(&tx_pending) >= TX_MAX_PENDING_COUNT)) {
-		esp_tx_pause(cb->priv);
-		dev_kfree_skb(skb);
-		skb = NULL;
-		/* printk(KERN_ERR "%s: TX Pause busy", __func__);*/
-		if (spi_context.spi_workqueue)
-			queue_work(spi_context.spi_workqueue, &spi_context.spi_work);
-		return -EBUSY;
+	if (prio >= PRIO_Q_LOW && cb && cb->priv) {
+		if (skb_queue_len(&context->tx_q[prio]) >= TX_MAX_PENDING_COUNT) {
+			/* Not expected, netdev queue is stopped well before */
+			esp_tx_pause(cb->priv, prio - PRIO_Q_LOW);
+			dev_kfree_skb(skb);
+			skb = NULL;
+			spi_kick(context);
+			return -EBUSY;
+		}
+
+		/* Stop before frame is visible to esp_spi_work, so that
+		 * its dequeue is sure to see stopped queue for resume */
+		if (skb_queue_len(&context->tx_q[prio]) + 1 >= TX_STOP_THRESHOLD)
+			esp_tx_pause(cb->priv, prio - PRIO_Q_LOW);
+
+		esp_tx_sent(cb->priv, prio - PRIO_Q_LOW, skb->len);
 	}
 
 	/* Enqueue SKB in tx_q */
-	if (payload_header->if_type == ESP_INTERNAL_IF) {
-		skb_queue_tail(&spi_context.tx_q[PRIO_Q_HIGH], skb);
-	} else if (payload_header->if_type == ESP_HCI_IF) {
-		skb_queue_tail(&spi_context.tx_q[PRIO_Q_MID], skb);
-	} else {
-		skb_queue_tail(&spi_context.tx_q[PRIO_Q_LOW], skb);
-		atomic_inc(&tx_pending);
-	}
+	skb_queue_tail(&context->tx_q[prio], skb);
+
+	if (prio >= PRIO_Q_LOW)
+		atomic_inc(&context->tx_pending);
 
-	if (spi_context.spi_workqueue)
-		queue_work(spi_context.spi_workqueue, &spi_context.spi_work);
+	spi_kick(context);
 
 	return 0;
 }
 
+static int write_packet_batch(struct esp_adapter *adapter, struct sk_buff_head *list)
+{
+	u32 max_pkt_size = SPI_BUF_SIZE - sizeof(struct esp_payload_header);
+	struct esp_payload_header *payload_header = NULL;
+	struct esp_spi_context *context = NULL;
+	struct esp_skb_cb * cb = NULL;
+	struct sk_buff *skb = NULL;
+	int ret = 0;
+	u8 prio;
+
+	if (!adapter || !adapter->if_context || !list) {
+		printk (KERN_ERR "%s: Invalid args\n", __func__);
+		return -EINVAL;
+	}
+
+	context = adapter->if_context;
+
+	if (!context->data_path) {
+		return -EPERM;
+	}
+
+	while ((skb = skb_peek(list))) {
+		if (!skb->len || skb->len > max_pkt_size) {
+			ret = -EPERM;
+			break;
+		}
+
+		payload_header = (struct esp_payload_header *) skb->data;
+		prio = esp_get_tx_prio_q(payload_header);
+
+		cb = (struct esp_skb_cb *)skb->cb;
+		if (prio >= PRIO_Q_LOW && cb && cb->priv) {
+			if (skb_queue_len(&context->tx_q[prio]) >= TX_MAX_PENDING_COUNT) {
+				/* Not expected, netdev queue is stopped well before */
+				esp_tx_pause(cb->priv, prio - PRIO_Q_LOW);
+				ret = -EBUSY;
+				break;
+			}
+
+			if (skb_queue_len(&context->tx_q[prio]) + 1 >= TX_STOP_THRESHOLD)
+				esp_tx_pause(cb->priv, prio - PRIO_Q_LOW);
+
+			esp_tx_sent(cb->priv, prio - PRIO_Q_LOW, skb->len);
+		}
+
+		__skb_unlink(skb, list);
+
+		skb_queue_tail(&context->tx_q[prio], skb);
+
+		if (prio >= PRIO_Q_LOW)
+			atomic_inc(&context->tx_pending);
+	}
+
+	/* Single kick for the whole batch */
+	spi_kick(context);
+
+	return ret;
+}
+
+/* Drops TX frames not yet on the wire, along with slot references to
+ * their netdevs, before those netdevs go away */
+static void spi_drop_pending_tx(struct esp_spi_context *context)
+{
+	uint8_t prio_q_idx = 0;
+
+	mutex_lock(&context->spi_lock);
+	spi_slots_drain(context);
+
+	for (prio_q_idx=0; prio_q_idx<MAX_PRIORITY_QUEUES; prio_q_idx++) {
+		skb_queue_purge(&context->tx_q[prio_q_idx]);
+	}
+	mutex_unlock(&context->spi_lock);
+}
+
 static void network_cmd_reinit(struct work_struct *work)
 {
-	struct esp_adapter * adapter = esp_get_adapter();
+	struct esp_spi_context *context = container_of(work,
+			struct esp_spi_context, nw_cmd_reinit_work);
+	struct esp_adapter * adapter = context->adapter;
 
 	if (!adapter) {
 		printk(KERN_INFO "adapter not yet init\n");
@@ -187,7 +397,7 @@ void process_event_esp_bootup(struct esp_adapter *adapter, u8 *evt_buf, u8 len)
 	u8 len_left = len, tag_len;
 	u8 *pos;
 	uint8_t iface_idx = 0;
-	uint8_t prio_q_idx = 0;
+	struct esp_spi_context *context = NULL;
 
 	if (!adapter)
 		return;
@@ -195,8 +405,17 @@ void process_event_esp_bootup(struct esp_adapter *adapter, u8 *evt_buf, u8 len)
 	if (!evt_buf)
 		return;
 
+	context = adapter->if_context;
+
+	/* Rebooted slave runs full length transfers until it advertises
+	 * ESP_SPI_VAR_LEN again, in TLVs below */
+	mutex_lock(&context->spi_lock);
+	context->var_len = 0;
+	adapter->ext_capabilities = 0;
+	mutex_unlock(&context->spi_lock);
+
 	/* Second & onward bootup, cleanup and re-init the driver */
-	if (esp_reset_after_module_load)
+	if (context->esp_reset_after_module_load)
 		set_bit(ESP_CLEANUP_IN_PROGRESS, &adapter->state_flags);
 
 	pos = evt_buf;
@@ -211,23 +430,28 @@ void process_event_esp_bootup(struct esp_adapter *adapter, u8 *evt_buf, u8 len)
 
 			adapter->capabilities = *(pos + 2);
 
+		} else if (*pos == ESP_BOOTUP_CAPABILITY_EXT) {
+
+			process_ext_capabilities(adapter, pos + 2, tag_len);
+
 		} else if (*pos == ESP_BOOTUP_FW_DATA) {
 
 			if (tag_len != sizeof(struct fw_data))
 				printk(KERN_INFO "Length not matching to firmware data size\n");
 			else
 				if (process_fw_data((struct fw_data*)(pos + 2))) {
-					esp_remove_card(spi_context.adapter);
+					spi_drop_pending_tx(context);
+					esp_remove_card(adapter);
 					return;
 				}
 
 		} else if (*pos == ESP_BOOTUP_SPI_CLK_MHZ){
 
-			adjust_spi_clock(*(pos + 2));
+			adjust_spi_clock(context, *(pos + 2));
 
 		} else if (*pos == ESP_BOOTUP_FIRMWARE_CHIP_ID){
 
-			hardware_type = *(pos+2);
+			context->hardware_type = *(pos+2);
 
 		} else {
 			printk (KERN_WARNING "Unsupported tag in event");
@@ -237,12 +461,12 @@ void process_event_esp_bootup(struct esp_adapter *adapter, u8 *evt_buf, u8 len)
 		len_left -= (tag_len+2);
 	}
 
-	if ((hardware_type != ESP_FIRMWARE_CHIP_ESP32) &&
-	    (hardware_type != ESP_FIRMWARE_CHIP_ESP32S2) &&
-	    (hardware_type != ESP_FIRMWARE_CHIP_ESP32C3) &&
-	    (hardware_type != ESP_FIRMWARE_CHIP_ESP32S3)) {
-		printk(KERN_INFO "ESP chipset not recognized, ignoring [%d]\n", hardware_type);
-		hardware_type = ESP_FIRMWARE_CHIP_UNRECOGNIZED;
+	if ((context->hardware_type != ESP_FIRMWARE_CHIP_ESP32) &&
+	    (context->hardware_type != ESP_FIRMWARE_CHIP_ESP32S2) &&
+	    (context->hardware_type != ESP_FIRMWARE_CHIP_ESP32C3) &&
+	    (context->hardware_type != ESP_FIRMWARE_CHIP_ESP32S3)) {
+		printk(KERN_INFO "ESP chipset not recognized, ignoring [%d]\n", context->hardware_type);
+		context->hardware_type = ESP_FIRMWARE_CHIP_UNRECOGNIZED;
 	} else {
 		printk(KERN_INFO "ESP chipset detected [%s]\n", 
 				*(pos+2)==ESP_FIRMWARE_CHIP_ESP32 ? "esp32":
@@ -252,7 +476,7 @@ void process_event_esp_bootup(struct esp_adapter *adapter, u8 *evt_buf, u8 len)
 				"unknown");
 	}
 
-	if (esp_reset_after_module_load) {
+	if (context->esp_reset_after_module_load) {
 
 		/* Second & onward bootup:
 		 *
@@ -271,9 +495,7 @@ void process_event_esp_bootup(struct esp_adapter *adapter, u8 *evt_buf, u8 len)
 		 *   there is no need to re-init them
 		 */
 
-		for (prio_q_idx=0; prio_q_idx<MAX_PRIORITY_QUEUES; prio_q_idx++) {
-			skb_queue_purge(&spi_context.tx_q[prio_q_idx]);
-		}
+		spi_drop_pending_tx(context);
 
 		for (iface_idx=0; iface_idx < ESP_MAX_INTERFACE; iface_idx++) {
 
@@ -304,9 +526,8 @@ void process_event_esp_bootup(struct esp_adapter *adapter, u8 *evt_buf, u8 len)
 
 		esp_remove_card(adapter);
 
-		for (prio_q_idx=0; prio_q_idx<MAX_PRIORITY_QUEUES; prio_q_idx++) {
-			skb_queue_head_init(&spi_context.tx_q[prio_q_idx]);
-		}
+		/* Frames sent before netdevs were unregistered */
+		spi_drop_pending_tx(context);
 	}
 
 	if (esp_add_card(adapter)) {
@@ -316,12 +537,19 @@ void process_event_esp_bootup(struct esp_adapter *adapter, u8 *evt_buf, u8 len)
 	process_capabilities(adapter);
 	print_capabilities(adapter->capabilities);
 
+	/* Transfers of this bootup event were full length, following ones
+	 * are as long as frames need */
+	mutex_lock(&context->spi_lock);
+	context->var_len = spi_var_len &&
+		(adapter->ext_capabilities & ESP_SPI_VAR_LEN);
+	mutex_unlock(&context->spi_lock);
+
 
-	esp_reset_after_module_load = 1;
+	context->esp_reset_after_module_load = 1;
 }
 
 
-static int process_rx_buf(struct sk_buff *skb)
+static int process_rx_buf(struct esp_spi_context *context, struct sk_buff *skb)
 {
 	struct esp_payload_header *header;
 	u16 len = 0;
@@ -358,118 +586,699 @@ static int process_rx_buf(struct sk_buff *skb)
 	skb_trim(skb, len);
 
 
-	if (!data_path) {
+	if (!context->data_path) {
 		/*printk(KERN_INFO "%s:%u datapath closed\n",__func__,__LINE__);*/
 		return -EPERM;
 	}
 
 	/* enqueue skb for read_packet to pick it */
 	if (header->if_type == ESP_INTERNAL_IF)
-		skb_queue_tail(&spi_context.rx_q[PRIO_Q_HIGH], skb);
+		skb_queue_tail(&context->rx_q[PRIO_Q_HIGH], skb);
 	else if (header->if_type == ESP_HCI_IF)
-		skb_queue_tail(&spi_context.rx_q[PRIO_Q_MID], skb);
+		skb_queue_tail(&context->rx_q[PRIO_Q_MID], skb);
 	else
-		skb_queue_tail(&spi_context.rx_q[PRIO_Q_LOW], skb);
+		skb_queue_tail(&context->rx_q[PRIO_Q_LOW], skb);
 
 	/* indicate reception of new packet */
-	esp_process_new_packet_intr(spi_context.adapter);
+	esp_process_new_packet_intr(context->adapter);
 
 	return 0;
 }
 
-static void esp_spi_work(struct work_struct *work)
+/* Bytes of frame whose payload header is at rx_buf, 0 if none or invalid */
+static u32 spi_rx_frame_len(u8 *rx_buf)
 {
-	struct spi_transfer trans;
-	struct sk_buff *tx_skb = NULL, *rx_skb = NULL;
+	struct esp_payload_header *header = (struct esp_payload_header *) rx_buf;
+	u16 offset = le16_to_cpu(header->offset);
+	u16 len = le16_to_cpu(header->len);
+
+	if (header->if_type >= ESP_MAX_IF || offset != sizeof(*header))
+		return 0;
+
+	if (len > SPI_BUF_SIZE - offset)
+		return 0;
+
+	return offset + len;
+}
+
+/* Frame received in slot as skb, NULL if none. Short frames are copied,
+ * longer ones take over RX buffer of slot */
+static struct sk_buff * spi_rx_skb(struct esp_spi_slot *slot)
+{
+	struct sk_buff *skb = NULL;
+	u32 len = spi_rx_frame_len(slot->rx_buf);
+
+	if (len <= ESP_PAYLOAD_HEADER)
+		return NULL;
+
+	if (len <= SPI_RX_COPYBREAK) {
+		skb = esp_alloc_skb(len);
+		if (skb)
+			memcpy(skb_put(skb, len), slot->rx_buf, len);
+
+		return skb;
+	}
+
+	skb = build_skb(slot->rx_buf - NET_SKB_PAD, SPI_RX_BUF_TRUESIZE);
+	if (!skb)
+		return NULL;
+
+	skb_reserve(skb, NET_SKB_PAD);
+	skb_put(skb, len);
+
+	/* Replaced at next spi_slot_prepare() */
+	slot->rx_buf = NULL;
+
+	return skb;
+}
+
+static void spi_free_rx_buf(struct esp_spi_slot *slot)
+{
+	if (slot->rx_buf)
+		put_page(virt_to_head_page(slot->rx_buf - NET_SKB_PAD));
+
+	slot->rx_buf = NULL;
+}
+
+/* Describe one SPI_BUF_SIZE transaction as transfers over skb head and
+ * frags, followed by zero padding. RX side lands contiguously in rx_buf.
+ * Dummy TX, without tx_skb, is all zeroes */
+static int fill_spi_transfers(struct spi_transfer *trans,
+		struct sk_buff *tx_skb, u8 *rx_buf)
+{
+	const skb_frag_t *frag = NULL;
+	u32 offset = 0;
+	int num_trans = 0;
+	int i = 0;
+
+	memset(trans, 0, sizeof(*trans) * SPI_MAX_TRANSFERS);
+
+	if (!tx_skb) {
+		trans[0].tx_buf = NULL;
+		trans[0].rx_buf = rx_buf;
+		trans[0].len = SPI_BUF_SIZE;
+		return 1;
+	}
+
+	/* Frag lists are not expected, NETIF_F_FRAGLIST is not advertised */
+	if (skb_has_frag_list(tx_skb) && skb_linearize(tx_skb))
+		return -ENOMEM;
+
+	trans[num_trans].tx_buf = tx_skb->data;
+	trans[num_trans].rx_buf = rx_buf;
+	trans[num_trans].len = skb_headlen(tx_skb);
+	offset += trans[num_trans].len;
+	num_trans++;
+
+	for (i = 0; i < skb_shinfo(tx_skb)->nr_frags; i++) {
+		frag = &skb_shinfo(tx_skb)->frags[i];
+
+		trans[num_trans].tx_buf = skb_frag_address(frag);
+		trans[num_trans].rx_buf = rx_buf + offset;
+		trans[num_trans].len = skb_frag_size(frag);
+		offset += trans[num_trans].len;
+		num_trans++;
+	}
+
+	if (offset < SPI_BUF_SIZE) {
+		/* NULL tx_buf shifts out zeroes */
+		trans[num_trans].tx_buf = NULL;
+		trans[num_trans].rx_buf = rx_buf + offset;
+		trans[num_trans].len = SPI_BUF_SIZE - offset;
+		num_trans++;
+	}
+
+	return num_trans;
+}
+
+/* Takes next TX frame and describes transaction for it in slot. Without
+ * TX frame, dummy TX is used only if allow_dummy, for RX pending at slave.
+ * Caller holds spi_lock */
+static int spi_slot_prepare(struct esp_spi_context *context,
+		struct esp_spi_slot *slot, bool allow_dummy)
+{
+	struct sk_buff *tx_skb = NULL;
 	struct esp_skb_cb * cb = NULL;
-	u8 *rx_buf = NULL;
-	int ret = 0;
-	volatile int trans_ready, rx_pending;
+	u8 *frag = NULL;
+	u8 prio;
 
-	mutex_lock(&spi_lock);
+	slot->tx_priv = NULL;
+	slot->tx_len = 0;
 
-	trans_ready = gpio_get_value(HANDSHAKE_PIN);
-	rx_pending = gpio_get_value(SPI_DATA_READY_PIN);
+	if (context->data_path) {
+		prio = esp_tx_sched_select(&context->adapter->tx_sched, context->tx_q);
+
+		if (prio < MAX_PRIORITY_QUEUES)
+			tx_skb = skb_dequeue(&context->tx_q[prio]);
 
-	if (trans_ready) {
-		if (data_path) {
-			tx_skb = skb_dequeue(&spi_context.tx_q[PRIO_Q_HIGH]);
-			if (!tx_skb)
-				tx_skb = skb_dequeue(&spi_context.tx_q[PRIO_Q_MID]);
-			if (!tx_skb)
-				tx_skb = skb_dequeue(&spi_context.tx_q[PRIO_Q_LOW]);
-			if (tx_skb) {
-				if (atomic_read(&tx_pending))
-					atomic_dec(&tx_pending);
+		if (tx_skb)
+			esp_tx_sched_charge(&context->adapter->tx_sched, prio, tx_skb->len);
+
+		if (tx_skb && prio >= PRIO_Q_LOW) {
+			if (atomic_read(&context->tx_pending))
+				atomic_dec(&context->tx_pending);
+
+			cb = (struct esp_skb_cb *)tx_skb->cb;
+			if (cb && cb->priv) {
+				slot->tx_priv = cb->priv;
+				esp_tx_completed(cb->priv, prio - PRIO_Q_LOW, 1, tx_skb->len);
 
 				/* resume network tx queue if bearable load */
-				cb = (struct esp_skb_cb *)tx_skb->cb;
-				if (cb && cb->priv && atomic_read(&tx_pending) < TX_RESUME_THRESHOLD) {
-					esp_tx_resume(cb->priv);
-				}
+				if (skb_queue_len(&context->tx_q[prio]) < TX_RESUME_THRESHOLD)
+					esp_tx_resume(cb->priv, prio - PRIO_Q_LOW);
 			}
 		}
+	}
 
-		if (rx_pending || tx_skb) {
-			memset(&trans, 0, sizeof(trans));
-
-			/* Setup and execute SPI transaction
-			 * 	Tx_buf: Check if tx_q has valid buffer for transmission,
-			 * 		else keep it blank
-			 *
-			 * 	Rx_buf: Allocate memory for incoming data. This will be freed
-			 *		immediately if received buffer is invalid.
-			 *		If it is a valid buffer, upper layer will free it.
-			 * */
-
-			/* Configure TX buffer if available */
-
-			if (tx_skb) {
-				trans.tx_buf = tx_skb->data;
-				/*print_hex_dump(KERN_ERR, "tx: ", DUMP_PREFIX_ADDRESS, 16, 1, trans.tx_buf, 32, 1);*/
-			} else {
-				tx_skb = esp_alloc_skb(SPI_BUF_SIZE);
-				trans.tx_buf = skb_put(tx_skb, SPI_BUF_SIZE);
-				memset((void*)trans.tx_buf, 0, SPI_BUF_SIZE);
-			}
+	/* Setup SPI transaction
+	 * 	Tx_buf: TX frame if available, else dummy TX of zeroes
+	 *
+	 * 	Rx_buf: Kept by slot across transactions. Only a long frame
+	 *		received into it takes it over, see spi_rx_skb().
+	 *		Needs no clearing, frame length is told by header.
+	 * */
+	if (tx_skb)
+		slot->tx_len = tx_skb->len;
+	else if (!allow_dummy)
+		return -ENODATA;
+
+	if (!slot->rx_buf) {
+		frag = netdev_alloc_frag(SPI_RX_BUF_TRUESIZE);
+		if (!frag)
+			goto drop;
+
+		slot->rx_buf = frag + NET_SKB_PAD;
+	}
+
+	/* TX is gathered from skb head and frags, without copy */
+	slot->num_trans = fill_spi_transfers(slot->trans, tx_skb, slot->rx_buf);
+	if (slot->num_trans <= 0)
+		goto drop;
+
+	slot->tx_skb = tx_skb;
+
+	return 0;
+
+drop:
+	if (slot->tx_priv)
+		esp_tx_drop(slot->tx_priv, ESP_TX_DROP_TRANSPORT);
+	dev_kfree_skb(tx_skb);
 
-			/* Configure RX buffer */
-			rx_skb = esp_alloc_skb(SPI_BUF_SIZE);
-			rx_buf = skb_put(rx_skb, SPI_BUF_SIZE);
+	return -ENOMEM;
+}
+
+/* Ends transaction of slot: received frame goes up, TX frame is freed */
+static void spi_slot_finish(struct esp_spi_context *context,
+		struct esp_spi_slot *slot, int ret)
+{
+	struct sk_buff *rx_skb = NULL;
+
+	if (ret) {
+		printk(KERN_ERR "SPI Transaction failed: %d", ret);
+		if (slot->tx_priv)
+			esp_tx_drop(slot->tx_priv, ESP_TX_DROP_BUS_ERROR);
+		if (context->spi_clk_errors < U8_MAX)
+			context->spi_clk_errors++;
+	} else {
+		context->spi_clk_errors = 0;
+		rx_skb = spi_rx_skb(slot);
 
-			memset(rx_buf, 0, SPI_BUF_SIZE);
+		/* Free rx_skb if received data is not valid */
+		if (rx_skb && process_rx_buf(context, rx_skb))
+			dev_kfree_skb(rx_skb);
+	}
 
-			trans.rx_buf = rx_buf;
-			trans.len = SPI_BUF_SIZE;
+	dev_kfree_skb(slot->tx_skb);
+
+	slot->tx_skb = NULL;
+	slot->tx_priv = NULL;
+	slot->state = SPI_SLOT_FREE;
+}
+
+/* Whole transaction of slot as one message */
+static void spi_fixed_len_msg(struct esp_spi_context *context,
+		struct esp_spi_slot *slot)
+{
+	int i = 0;
 
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 15, 0))
-			if (hardware_type == ESP_FIRMWARE_CHIP_ESP32) {
-				trans.cs_change = 1;
-			}
+	if (context->hardware_type == ESP_FIRMWARE_CHIP_ESP32) {
+		slot->trans[slot->num_trans - 1].cs_change = 1;
+	}
 #endif
 
-			ret = spi_sync_transfer(spi_context.esp_spi_dev, &trans, 1);
-			if (ret) {
-				printk(KERN_ERR "SPI Transaction failed: %d", ret);
-				dev_kfree_skb(rx_skb);
-				dev_kfree_skb(tx_skb);
-			} else {
+	spi_message_init(&slot->msg);
 
-				/* Free rx_skb if received data is not valid */
-				if (process_rx_buf(rx_skb)) {
-					dev_kfree_skb(rx_skb);
-				}
+	for (i = 0; i < slot->num_trans; i++)
+		spi_message_add_tail(&slot->trans[i], &slot->msg);
+}
+
+/* Variable length mode, first message: payload headers of both sides.
+ * Chip select stays asserted for spi_var_len_msg() */
+static void spi_var_len_hdr(struct esp_spi_slot *slot)
+{
+	struct spi_transfer *trans = slot->trans;
+
+	memset(&slot->hdr, 0, sizeof(slot->hdr));
+
+	/* Payload header is always in skb head */
+	slot->hdr.tx_buf = trans[0].tx_buf;
+	slot->hdr.rx_buf = trans[0].rx_buf;
+	slot->hdr.len = ESP_PAYLOAD_HEADER;
+	slot->hdr.cs_change = 1;
 
-				if (tx_skb)
-					dev_kfree_skb(tx_skb);
+	/* Dummy TX stays NULL */
+	if (trans[0].tx_buf)
+		trans[0].tx_buf = (const u8 *) trans[0].tx_buf + ESP_PAYLOAD_HEADER;
+	trans[0].rx_buf = (u8 *) trans[0].rx_buf + ESP_PAYLOAD_HEADER;
+	trans[0].len -= ESP_PAYLOAD_HEADER;
+
+	spi_message_init(&slot->hdr_msg);
+	spi_message_add_tail(&slot->hdr, &slot->hdr_msg);
+}
+
+/* Variable length mode, second message: rest of longer frame only, as
+ * told by headers. Transfers cover whole SPI_BUF_SIZE, so are cut */
+static void spi_var_len_msg(struct esp_spi_slot *slot)
+{
+	u32 len = 0, left = 0;
+	int i = 0;
+
+	len = max(slot->tx_len, spi_rx_frame_len(slot->rx_buf));
+	len = ALIGN(max_t(u32, len, SPI_VAR_LEN_MIN), SPI_VAR_LEN_ALIGN);
+	left = min_t(u32, len, SPI_BUF_SIZE) - ESP_PAYLOAD_HEADER;
+
+	spi_message_init(&slot->msg);
+
+	for (i = 0; i < slot->num_trans && left; i++) {
+		if (!slot->trans[i].len)
+			continue;
+
+		if (slot->trans[i].len > left)
+			slot->trans[i].len = left;
+
+		left -= slot->trans[i].len;
+		spi_message_add_tail(&slot->trans[i], &slot->msg);
+	}
+}
+
+/* Both messages of variable length transaction, bus locked in between
+ * so that slave sees single transaction. Caller holds spi_lock */
+static int spi_var_len_transfer(struct esp_spi_context *context,
+		struct esp_spi_slot *slot)
+{
+	struct spi_device *spi = context->esp_spi_dev;
+	int ret = 0;
+
+	spi_var_len_hdr(slot);
+
+	spi_bus_lock(spi->master);
+
+	ret = spi_sync_locked(spi, &slot->hdr_msg);
+
+	if (!ret) {
+		spi_var_len_msg(slot);
+		ret = spi_sync_locked(spi, &slot->msg);
+	}
+
+	spi_bus_unlock(spi->master);
+
+	return ret;
+}
+
+/* Pipeline mode. May run in atomic context of SPI controller */
+static void spi_slot_signal(struct esp_spi_slot *slot, int ret)
+{
+	struct esp_spi_context *context = slot->context;
+	unsigned long flags;
+
+	/* spi_exit() clears spi_workqueue under the same lock */
+	spin_lock_irqsave(&context->slot_lock, flags);
+
+	slot->ret = ret;
+	complete(&slot->done);
+
+	/* Slot is reaped, and next transaction launched, by esp_spi_run */
+	spi_kick(context);
+
+	spin_unlock_irqrestore(&context->slot_lock, flags);
+}
+
+static void spi_slot_msg_done(void *data)
+{
+	struct esp_spi_slot *slot = data;
+
+	spi_slot_signal(slot, slot->msg.status);
+}
+
+/* Second message is queued right away from here, chip select is still
+ * asserted. Unlike spi_var_len_transfer(), bus is not locked in between,
+ * which is fine as long as ESP is alone on its bus */
+static void spi_slot_hdr_done(void *data)
+{
+	struct esp_spi_slot *slot = data;
+	int ret = slot->hdr_msg.status;
+
+	if (!ret) {
+		spi_var_len_msg(slot);
+		slot->msg.complete = spi_slot_msg_done;
+		slot->msg.context = slot;
+
+		ret = spi_async(slot->context->esp_spi_dev, &slot->msg);
+	}
+
+	if (ret)
+		spi_slot_signal(slot, ret);
+}
+
+static int spi_slot_submit(struct esp_spi_context *context,
+		struct esp_spi_slot *slot)
+{
+	int ret = 0;
+
+	reinit_completion(&slot->done);
+
+	if (context->var_len) {
+		spi_var_len_hdr(slot);
+		slot->hdr_msg.complete = spi_slot_hdr_done;
+		slot->hdr_msg.context = slot;
+
+		ret = spi_async(context->esp_spi_dev, &slot->hdr_msg);
+	} else {
+		spi_fixed_len_msg(context, slot);
+		slot->msg.complete = spi_slot_msg_done;
+		slot->msg.context = slot;
+
+		ret = spi_async(context->esp_spi_dev, &slot->msg);
+	}
+
+	if (!ret)
+		slot->state = SPI_SLOT_BUSY;
+
+	spi_irq_latency_sample(context);
+
+	return ret;
+}
+
+static struct esp_spi_slot * spi_find_slot(struct esp_spi_context *context,
+		u8 state)
+{
+	int i = 0;
+
+	for (i = 0; i < SPI_SLOTS; i++)
+		if (context->slot[i].state == state)
+			return &context->slot[i];
+
+	return NULL;
+}
+
+/* Pipeline mode: one transaction on the wire, while previous one is
+ * reaped and next TX frame is staged. Still paced by handshake line,
+ * slave takes single transaction at a time. Caller holds spi_lock */
+static void esp_spi_pipeline(struct esp_spi_context *context)
+{
+	struct esp_spi_slot *busy = NULL, *done = NULL, *next = NULL;
+	int ret = 0;
+
+	/* At most one slot is busy once a run is over */
+	busy = spi_find_slot(context, SPI_SLOT_BUSY);
+
+	if (busy && completion_done(&busy->done)) {
+		done = busy;
+		busy = NULL;
+	}
+
+	/* Launch next transaction first, so that it overlaps with the rest */
+	if (!busy && gpio_get_value(HANDSHAKE_PIN)) {
+		next = spi_find_slot(context, SPI_SLOT_STAGED);
+
+		if (!next) {
+			next = spi_find_slot(context, SPI_SLOT_FREE);
+
+			if (!next && done) {
+				spi_slot_finish(context, done, done->ret);
+				next = done;
+				done = NULL;
 			}
+
+			if (next && spi_slot_prepare(context, next,
+					gpio_get_value(SPI_DATA_READY_PIN)))
+				next = NULL;
+		}
+
+		if (next) {
+			ret = spi_slot_submit(context, next);
+			if (ret)
+				spi_slot_finish(context, next, ret);
 		}
 	}
 
-	mutex_unlock(&spi_lock);
+	if (done)
+		spi_slot_finish(context, done, done->ret);
+
+	/* Stage next TX frame meanwhile */
+	if (!spi_find_slot(context, SPI_SLOT_STAGED)) {
+		next = spi_find_slot(context, SPI_SLOT_FREE);
+
+		if (next && !spi_slot_prepare(context, next, false))
+			next->state = SPI_SLOT_STAGED;
+	}
+}
+
+/* Waits for transaction on the wire and drops staged one */
+static void spi_slots_drain(struct esp_spi_context *context)
+{
+	struct esp_spi_slot *slot = NULL;
+	int i = 0;
+
+	for (i = 0; i < SPI_SLOTS; i++) {
+		slot = &context->slot[i];
+
+		if (slot->state == SPI_SLOT_BUSY)
+			wait_for_completion(&slot->done);
+
+		spi_free_rx_buf(slot);
+		dev_kfree_skb(slot->tx_skb);
+		slot->tx_skb = NULL;
+		slot->tx_priv = NULL;
+		slot->state = SPI_SLOT_FREE;
+	}
 }
 
-static int spi_dev_init(int spi_clk_mhz)
+/* Runs device at spi_clk_mhz from next transaction on. Transaction on the
+ * wire, in pipeline mode, is reaped first; staged one takes new clock at
+ * submission. Caller holds spi_lock */
+static int spi_apply_clock(struct esp_spi_context *context, u8 spi_clk_mhz)
+{
+	struct spi_device *spi = context->esp_spi_dev;
+	struct esp_spi_slot *slot = NULL;
+	u32 old_hz = 0;
+	int ret = 0;
+
+	if (!spi)
+		return -ENODEV;
+
+	slot = spi_find_slot(context, SPI_SLOT_BUSY);
+	if (slot) {
+		wait_for_completion(&slot->done);
+		spi_slot_finish(context, slot, slot->ret);
+	}
+
+	old_hz = spi->max_speed_hz;
+	spi->max_speed_hz = spi_clk_mhz * NUMBER_1M;
+
+	ret = spi_setup(spi);
+	if (ret) {
+		printk(KERN_ERR "%s: Failed to set SPI clock to %u MHz: %d\n",
+				__func__, spi_clk_mhz, ret);
+		spi->max_speed_hz = old_hz;
+		spi_setup(spi);
+		return ret;
+	}
+
+	context->spi_clk_mhz = spi_clk_mhz;
+	context->spi_clk_errors = 0;
+
+	return 0;
+}
+
+/* Halves clock after repeated transaction errors, down to the initial one
+ * which bootup went through. Caller holds spi_lock */
+static void spi_lower_clock(struct esp_spi_context *context)
+{
+	u8 spi_clk_mhz = context->spi_clk_mhz;
+
+	context->spi_clk_errors = 0;
+
+	if (spi_clk_mhz <= SPI_INITIAL_CLK_MHZ)
+		return;
+
+	spi_clk_mhz = max_t(u8, spi_clk_mhz / 2, SPI_INITIAL_CLK_MHZ);
+
+	printk(KERN_WARNING "%s: SPI transactions failing, lowering clock to %u MHz\n",
+			__func__, spi_clk_mhz);
+
+	spi_apply_clock(context, spi_clk_mhz);
+}
+
+/* Runs single transaction, or a pipeline step. Returns true if another
+ * transaction may follow right away */
+static bool esp_spi_run_once(struct esp_spi_context *context)
+{
+	struct esp_spi_slot *slot = &context->slot[0];
+	bool done = false;
+	int ret = 0;
+	volatile int trans_ready, rx_pending;
+
+	mutex_lock(&context->spi_lock);
+
+	if (context->spi_stopped) {
+		mutex_unlock(&context->spi_lock);
+		return false;
+	}
+
+	/* Driven by completion callbacks from here on */
+	if (spi_pipeline) {
+		esp_spi_pipeline(context);
+		goto out;
+	}
+
+	trans_ready = gpio_get_value(HANDSHAKE_PIN);
+	rx_pending = gpio_get_value(SPI_DATA_READY_PIN);
+
+	/* Nothing to do unless there is TX frame or RX pending */
+	if (trans_ready && !spi_slot_prepare(context, slot, rx_pending)) {
+
+		spi_irq_latency_sample(context);
+
+		if (context->var_len) {
+			ret = spi_var_len_transfer(context, slot);
+		} else {
+			spi_fixed_len_msg(context, slot);
+			ret = spi_sync(context->esp_spi_dev, &slot->msg);
+		}
+
+		spi_slot_finish(context, slot, ret);
+		done = !ret;
+	} else if (spi_irq_latency) {
+		/* IRQ led to no transaction */
+		atomic64_set(&context->irq_stamp, 0);
+	}
+
+out:
+	if (context->spi_clk_errors >= SPI_CLK_ERR_THRESHOLD)
+		spi_lower_clock(context);
+
+	mutex_unlock(&context->spi_lock);
+
+	return done;
+}
+
+static void esp_spi_work(struct work_struct *work)
+{
+	struct esp_spi_context *context = container_of(work,
+			struct esp_spi_context, spi_work);
+
+	esp_spi_run_once(context);
+}
+
+/* Threaded IRQ mode: transactions back to back while slave keeps
+ * handshake line up, with no workqueue in between */
+static irqreturn_t spi_irq_thread_fn(int irq, void * dev)
+{
+	struct esp_spi_context *context = dev;
+
+	/* IRQ threads start as SCHED_FIFO */
+	if (!spi_irq_fifo && current->policy != SCHED_NORMAL) {
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0))
+		sched_set_normal(current, 0);
+#else
+		struct sched_param param = { .sched_priority = 0 };
+
+		sched_setscheduler(current, SCHED_NORMAL, &param);
+#endif
+	}
+
+	while (esp_spi_run_once(context) && gpio_get_value(HANDSHAKE_PIN))
+		;
+
+	return IRQ_HANDLED;
+}
+
+/* Clock device is run at, may be below negotiated one after errors or
+ * as limited by SPI controller */
+static ssize_t spi_clk_hz_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct spi_device *spi = to_spi_device(dev);
+
+	return sprintf(buf, "%u\n", spi->max_speed_hz);
+}
+
+static DEVICE_ATTR(spi_clk_hz, S_IRUSR | S_IRGRP | S_IROTH, spi_clk_hz_show, NULL);
+
+/* IRQ to transaction latency, with spi_irq_latency set. Samples are
+ * taken under spi_lock, so are read under it, untorn on 32-bit hosts */
+static ssize_t irq_latency_samples_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct esp_spi_context *context = dev_get_drvdata(dev);
+	u64 samples;
+
+	mutex_lock(&context->spi_lock);
+	samples = context->irq_lat_samples;
+	mutex_unlock(&context->spi_lock);
+
+	return sprintf(buf, "%llu\n", samples);
+}
+
+static ssize_t irq_latency_avg_ns_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct esp_spi_context *context = dev_get_drvdata(dev);
+	u64 samples, total_ns;
+
+	mutex_lock(&context->spi_lock);
+	samples = context->irq_lat_samples;
+	total_ns = context->irq_lat_total_ns;
+	mutex_unlock(&context->spi_lock);
+
+	return sprintf(buf, "%llu\n", samples ? div64_u64(total_ns, samples) : 0);
+}
+
+static ssize_t irq_latency_max_ns_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct esp_spi_context *context = dev_get_drvdata(dev);
+	u64 max_ns;
+
+	mutex_lock(&context->spi_lock);
+	max_ns = context->irq_lat_max_ns;
+	mutex_unlock(&context->spi_lock);
+
+	return sprintf(buf, "%llu\n", max_ns);
+}
+
+static DEVICE_ATTR(irq_latency_samples, S_IRUSR | S_IRGRP | S_IROTH,
+		irq_latency_samples_show, NULL);
+static DEVICE_ATTR(irq_latency_avg_ns, S_IRUSR | S_IRGRP | S_IROTH,
+		irq_latency_avg_ns_show, NULL);
+static DEVICE_ATTR(irq_latency_max_ns, S_IRUSR | S_IRGRP | S_IROTH,
+		irq_latency_max_ns_show, NULL);
+
+static struct attribute *esp_spi_attrs[] = {
+	&dev_attr_spi_clk_hz.attr,
+	&dev_attr_irq_latency_samples.attr,
+	&dev_attr_irq_latency_avg_ns.attr,
+	&dev_attr_irq_latency_max_ns.attr,
+	NULL,
+};
+
+static const struct attribute_group esp_spi_attr_group = {
+	.attrs = esp_spi_attrs,
+};
+
+static int spi_dev_init(struct esp_spi_context *context, int spi_clk_mhz)
 {
 	int status = 0;
 	struct spi_board_info esp_board = {{0}};
@@ -487,14 +1296,14 @@ static int spi_dev_init(int spi_clk_mhz)
 		return -ENODEV;
 	}
 
-	spi_context.esp_spi_dev = spi_new_device(master, &esp_board);
+	context->esp_spi_dev = spi_new_device(master, &esp_board);
 
-	if (!spi_context.esp_spi_dev) {
+	if (!context->esp_spi_dev) {
 		printk(KERN_ERR "Failed to add new SPI device\n");
 		return -ENODEV;
 	}
 
-	status = spi_setup(spi_context.esp_spi_dev);
+	status = spi_setup(context->esp_spi_dev);
 
 	if (status) {
 		printk (KERN_ERR "Failed to setup new SPI device");
@@ -505,6 +1314,12 @@ static int spi_dev_init(int spi_clk_mhz)
 			",chip select [%d], SPI Clock [%d]\n", esp_board.bus_num,
 			esp_board.chip_select, spi_clk_mhz);
 
+	/* For sysfs attributes, no driver is bound to this device */
+	spi_set_drvdata(context->esp_spi_dev, context);
+
+	if (sysfs_create_group(&context->esp_spi_dev->dev.kobj, &esp_spi_attr_group))
+		printk (KERN_WARNING "Failed to create sysfs attributes of SPI device\n");
+
 	status = gpio_request(HANDSHAKE_PIN, "SPI_HANDSHAKE_PIN");
 
 	if (status) {
@@ -520,9 +1335,10 @@ static int spi_dev_init(int spi_clk_mhz)
 		return status;
 	}
 
-	status = request_irq(SPI_IRQ, spi_interrupt_handler,
+	status = request_threaded_irq(SPI_IRQ, spi_interrupt_handler,
+			spi_irq_thread ? spi_irq_thread_fn : NULL,
 			IRQF_SHARED | IRQF_TRIGGER_RISING,
-			"ESP_SPI", spi_context.esp_spi_dev);
+			"ESP_SPI", context);
 	if (status) {
 		gpio_free(HANDSHAKE_PIN);
 		printk (KERN_ERR "Failed to request IRQ for Handshake pin, err:%d\n",status);
@@ -532,7 +1348,7 @@ static int spi_dev_init(int spi_clk_mhz)
 	status = gpio_request(SPI_DATA_READY_PIN, "SPI_DATA_READY_PIN");
 	if (status) {
 		gpio_free(HANDSHAKE_PIN);
-		free_irq(SPI_IRQ, spi_context.esp_spi_dev);
+		free_irq(SPI_IRQ, context);
 		printk (KERN_ERR "Failed to obtain GPIO for Data ready pin, err:%d\n",status);
 		return status;
 	}
@@ -540,133 +1356,182 @@ static int spi_dev_init(int spi_clk_mhz)
 	status = gpio_direction_input(SPI_DATA_READY_PIN);
 	if (status) {
 		gpio_free(HANDSHAKE_PIN);
-		free_irq(SPI_IRQ, spi_context.esp_spi_dev);
+		free_irq(SPI_IRQ, context);
 		gpio_free(SPI_DATA_READY_PIN);
 		printk (KERN_ERR "Failed to set GPIO direction of Data ready pin\n");
 		return status;
 	}
 
-	status = request_irq(SPI_DATA_READY_IRQ, spi_data_ready_interrupt_handler,
+	status = request_threaded_irq(SPI_DATA_READY_IRQ, spi_data_ready_interrupt_handler,
+			spi_irq_thread ? spi_irq_thread_fn : NULL,
 			IRQF_SHARED | IRQF_TRIGGER_RISING,
-			"ESP_SPI_DATA_READY", spi_context.esp_spi_dev);
+			"ESP_SPI_DATA_READY", context);
 	if (status) {
 		gpio_free(HANDSHAKE_PIN);
-		free_irq(SPI_IRQ, spi_context.esp_spi_dev);
+		free_irq(SPI_IRQ, context);
 		gpio_free(SPI_DATA_READY_PIN);
 		printk (KERN_ERR "Failed to request IRQ for Data ready pin, err:%d\n",status);
 		return status;
 	}
-	spi_context.spi_gpio_enabled = 1;
+	context->spi_gpio_enabled = 1;
 
-	open_data_path();
+	open_data_path(context);
 
 	return 0;
 }
 
-static int spi_init(void)
+static int spi_init(struct esp_spi_context *context)
 {
 	int status = 0;
 	uint8_t prio_q_idx = 0;
 	struct esp_adapter *adapter;
 
-	spi_context.spi_workqueue = create_workqueue("ESP_SPI_WORK_QUEUE");
+	context->spi_workqueue = alloc_workqueue("ESP_SPI_WORK_QUEUE/%d",
+			WQ_MEM_RECLAIM, 1, context->adapter->idx);
 
-	if (!spi_context.spi_workqueue) {
+	if (!context->spi_workqueue) {
 		printk(KERN_ERR "spi workqueue failed to create\n");
-		spi_exit();
+		spi_exit(context);
 		return -EFAULT;
 	}
 
-	INIT_WORK(&spi_context.spi_work, esp_spi_work);
+	INIT_WORK(&context->spi_work, esp_spi_work);
 
 	for (prio_q_idx=0; prio_q_idx<MAX_PRIORITY_QUEUES; prio_q_idx++) {
-		skb_queue_head_init(&spi_context.tx_q[prio_q_idx]);
-		skb_queue_head_init(&spi_context.rx_q[prio_q_idx]);
+		skb_queue_head_init(&context->tx_q[prio_q_idx]);
+		skb_queue_head_init(&context->rx_q[prio_q_idx]);
 	}
 
-	status = spi_dev_init(spi_context.spi_clk_mhz);
+	status = spi_dev_init(context, context->spi_clk_mhz);
 	if (status) {
-		spi_exit();
+		spi_exit(context);
 		printk (KERN_ERR "Failed Init SPI device\n");
 		return status;
 	}
 
-	adapter = spi_context.adapter;
+	adapter = context->adapter;
 
 	if (!adapter) {
-		spi_exit();
+		spi_exit(context);
 		return -EFAULT;
 	}
 
-	adapter->dev = &spi_context.esp_spi_dev->dev;
+	adapter->dev = &context->esp_spi_dev->dev;
 
 	return status;
 }
 
-static void spi_exit(void)
+static void spi_exit(struct esp_spi_context *context)
 {
+	struct workqueue_struct *spi_workqueue = NULL;
+	unsigned long flags;
 	uint8_t prio_q_idx = 0;
 
 	disable_irq(SPI_IRQ);
 	disable_irq(SPI_DATA_READY_IRQ);
-	close_data_path();
+	close_data_path(context);
 	msleep(200);
 
 	for (prio_q_idx=0; prio_q_idx<MAX_PRIORITY_QUEUES; prio_q_idx++) {
-		skb_queue_purge(&spi_context.tx_q[prio_q_idx]);
-		skb_queue_purge(&spi_context.rx_q[prio_q_idx]);
+		skb_queue_purge(&context->tx_q[prio_q_idx]);
+		skb_queue_purge(&context->rx_q[prio_q_idx]);
 	}
 
-	if (spi_context.spi_workqueue) {
-		flush_scheduled_work();
-		destroy_workqueue(spi_context.spi_workqueue);
-		spi_context.spi_workqueue = NULL;
-	}
+	mutex_lock(&context->spi_lock);
+	context->spi_stopped = 1;
+	spi_slots_drain(context);
+	mutex_unlock(&context->spi_lock);
 
-	esp_remove_card(spi_context.adapter);
+	/* No completion callback may queue work past this point */
+	spin_lock_irqsave(&context->slot_lock, flags);
+	spi_workqueue = context->spi_workqueue;
+	context->spi_workqueue = NULL;
+	spin_unlock_irqrestore(&context->slot_lock, flags);
 
-	if (spi_context.adapter->hcidev)
-		esp_deinit_bt(spi_context.adapter);
+	/* Runs pending spi_work to completion first */
+	if (spi_workqueue)
+		destroy_workqueue(spi_workqueue);
 
-	if (spi_context.spi_gpio_enabled) {
-		free_irq(SPI_IRQ, spi_context.esp_spi_dev);
-		free_irq(SPI_DATA_READY_IRQ, spi_context.esp_spi_dev);
+	esp_remove_card(context->adapter);
+
+	if (context->adapter->hcidev)
+		esp_deinit_bt(context->adapter);
+
+	if (context->spi_gpio_enabled) {
+		free_irq(SPI_IRQ, context);
+		free_irq(SPI_DATA_READY_IRQ, context);
 
 		gpio_free(HANDSHAKE_PIN);
 		gpio_free(SPI_DATA_READY_PIN);
 	}
 
-	if (spi_context.esp_spi_dev)
-		spi_unregister_device(spi_context.esp_spi_dev);
+	if (context->esp_spi_dev) {
+		sysfs_remove_group(&context->esp_spi_dev->dev.kobj, &esp_spi_attr_group);
+		spi_unregister_device(context->esp_spi_dev);
+	}
 
-	memset(&spi_context, 0, sizeof(spi_context));
+	esp_free_adapter(context->adapter);
+	kfree(context);
 }
 
-static void adjust_spi_clock(u8 spi_clk_mhz)
+static void adjust_spi_clock(struct esp_spi_context *context, u8 spi_clk_mhz)
 {
-	if ((spi_clk_mhz) && (spi_clk_mhz != spi_context.spi_clk_mhz)) {
+	if ((spi_clk_mhz) && (spi_clk_mhz != context->spi_clk_mhz)) {
 		printk(KERN_INFO "ESP Reconfigure SPI CLK to %u MHz\n",spi_clk_mhz);
-		spi_context.spi_clk_mhz = spi_clk_mhz;
+
+		mutex_lock(&context->spi_lock);
+		spi_apply_clock(context, spi_clk_mhz);
+		mutex_unlock(&context->spi_lock);
 	}
 }
 
-int esp_init_interface_layer(struct esp_adapter *adapter)
+int esp_init_interface_layer(void)
 {
+	struct esp_spi_context *context = NULL;
+	struct esp_adapter *adapter = NULL;
+	int ret = 0;
+	u8 i = 0;
+
+	adapter = esp_alloc_adapter();
+
 	if (!adapter)
-		return -EINVAL;
+		return -ENOMEM;
+
+	context = kzalloc(sizeof(struct esp_spi_context), GFP_KERNEL);
+
+	if (!context) {
+		esp_free_adapter(adapter);
+		return -ENOMEM;
+	}
 
-	memset(&spi_context, 0, sizeof(spi_context));
+	mutex_init(&context->spi_lock);
+	spin_lock_init(&context->slot_lock);
+	atomic_set(&context->tx_pending, 0);
 
-	adapter->if_context = &spi_context;
+	for (i = 0; i < SPI_SLOTS; i++) {
+		context->slot[i].context = context;
+		init_completion(&context->slot[i].done);
+	}
+
+	adapter->if_context = context;
 	adapter->if_ops = &if_ops;
 	adapter->if_type = ESP_IF_TYPE_SPI;
-	spi_context.adapter = adapter;
-	spi_context.spi_clk_mhz = SPI_INITIAL_CLK_MHZ;
+	context->adapter = adapter;
+	context->spi_clk_mhz = SPI_INITIAL_CLK_MHZ;
+
+	/* context and adapter are freed by spi_exit() on failure */
+	ret = spi_init(context);
 
-	return spi_init();
+	if (!ret)
+		esp_spi_ctx = context;
+
+	return ret;
 }
 
 void esp_deinit_interface_layer(void)
 {
-	spi_exit();
+	if (esp_spi_ctx)
+		spi_exit(esp_spi_ctx);
+
+	esp_spi_ctx = NULL;
 }
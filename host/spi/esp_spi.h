@@ -17,6 +17,8 @@
 #ifndef _ESP_SPI_H_
 #define _ESP_SPI_H_
 
+#include <linux/spi/spi.h>
+#include <linux/completion.h>
 #include "esp.h"
 
 #define HANDSHAKE_PIN           22
@@ -24,6 +26,44 @@
 #define SPI_DATA_READY_PIN      27
 #define SPI_DATA_READY_IRQ      gpio_to_irq(SPI_DATA_READY_PIN)
 #define SPI_BUF_SIZE            1600
+/* Variable length mode: transfer length granularity of slave DMA */
+#define SPI_VAR_LEN_ALIGN       4
+#define SPI_VAR_LEN_MIN         (ESP_PAYLOAD_HEADER + SPI_VAR_LEN_ALIGN)
+/* skb head, each page frag and trailing padding */
+#define SPI_MAX_TRANSFERS       (MAX_SKB_FRAGS + 2)
+/* RX frames up to this long are copied, longer ones get buffer of slot */
+#define SPI_RX_COPYBREAK        256
+#define SPI_RX_BUF_TRUESIZE     (SKB_DATA_ALIGN(NET_SKB_PAD + SPI_BUF_SIZE) + \
+		SKB_DATA_ALIGN(sizeof(struct skb_shared_info)))
+/* Pipeline mode: one transaction on the wire, next one staged */
+#define SPI_SLOTS               2
+
+struct esp_spi_context;
+
+enum esp_spi_slot_state {
+	SPI_SLOT_FREE,
+	SPI_SLOT_STAGED,
+	SPI_SLOT_BUSY,
+};
+
+/* One SPI transaction, with its TX and RX buffers */
+struct esp_spi_slot {
+	struct esp_spi_context      *context;
+	struct spi_transfer         trans[SPI_MAX_TRANSFERS];
+	int                         num_trans;
+	struct spi_message          msg;
+	/* Variable length mode: payload headers, sent ahead of msg */
+	struct spi_transfer         hdr;
+	struct spi_message          hdr_msg;
+	struct sk_buff              *tx_skb;
+	/* Persistent RX buffer, NET_SKB_PAD into SPI_RX_BUF_TRUESIZE page frag */
+	u8                          *rx_buf;
+	struct esp_wifi_device      *tx_priv;
+	u32                         tx_len;
+	struct completion           done;
+	int                         ret;
+	u8                          state;
+};
 
 struct esp_spi_context {
 	struct esp_adapter          *adapter;
@@ -32,11 +72,28 @@ struct esp_spi_context {
 	struct sk_buff_head         rx_q[MAX_PRIORITY_QUEUES];
 	struct workqueue_struct     *spi_workqueue;
 	struct work_struct          spi_work;
+	struct esp_spi_slot         slot[SPI_SLOTS];
+	/* Serializes completion callbacks with spi_exit() */
+	spinlock_t                  slot_lock;
+	/* IRQ to transaction latency, in ns, under spi_lock */
+	atomic64_t                  irq_stamp;
+	u64                         irq_lat_samples;
+	u64                         irq_lat_total_ns;
+	u64                         irq_lat_max_ns;
 	struct workqueue_struct     *nw_cmd_reinit_workqueue;
 	struct work_struct          nw_cmd_reinit_work;
+	struct mutex                spi_lock;
+	atomic_t                    tx_pending;
+	volatile u8                 data_path;
+	char                        hardware_type;
+	uint8_t                     esp_reset_after_module_load;
 	uint8_t                     spi_clk_mhz;
 	uint8_t                     spi_gpio_enabled;
-	uint8_t                     reserved[2];
+	/* Transfers cut to frame length, see ESP_SPI_VAR_LEN */
+	uint8_t                     var_len;
+	uint8_t                     spi_stopped;
+	/* Consecutive failed transactions */
+	uint8_t                     spi_clk_errors;
 };
 
 enum {